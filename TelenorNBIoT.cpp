@@ -20,661 +20,2433 @@
 
 #define PREFIX "AT+"
 #define POSTFIX "\r"
-#define SOCR "NSOCR=\"DGRAM\",17,%d,1"
-#define SOSTF "NSOSTF="
-#define SOCL "NSOCL=%d"
-#define RECVFROM "NSORF=%d,%d"
-#define GPRS "CGATT?"
-#define REG_STATUS "CEREG?"
-#define IMSI "CIMI"
-#define IMEI "CGSN=1"
-#define REBOOT "NRB"
-#define RADIO_ON "CFUN=1"
-#define RADIO_OFF "CFUN=0"
-#define SIGNAL_STRENGTH "CSQ"
-#define CONNECT_DATA "CGATT=1"
-#define FIRMWARE "CGMR"
-#define READ_APN "CGDCONT?"
-#define SET_APN "CGDCONT=%d,\"IP\",\"%s\""
-#define ACTIVATE_APN "CGACT=1,%d"
-#define CONFIG_AUTOCONN "NCONFIG=\"AUTOCONNECT\",\"%s\""
-#define DEFAULT_TIMEOUT 2000
-
-int splitFields(char *line, char **fields, uint8_t maxFields);
-bool retry(uint8_t attempts, nonstd::function<bool ()> fn, uint16_t delayBetween = 100);
-
-TelenorNBIoT::TelenorNBIoT(String accessPointName, uint16_t mobileCountryCode, uint16_t mobileNetworkCode)
+#define URC_RECEIVED "+NSONMI"
+#define URC_CONNECTION "+CSCON"
+#define URC_REGISTRATION "+CEREG"
+#define REBOOT_TIMEOUT 10000
+
+// The command text for each at_command, without the "AT+" prefix. The
+// parameters are written in place of the % signs.
+static const char cmdErrorCodes[] PROGMEM = "CMEE=1";
+static const char cmdCreateSocket[] PROGMEM = "NSOCR=\"DGRAM\",17,%,1";
+static const char cmdSendTo[] PROGMEM = "NSOSTF=%,\"%.%.%.%\",%,%,%,\"";
+static const char cmdCloseSocket[] PROGMEM = "NSOCL=%";
+static const char cmdReceiveFrom[] PROGMEM = "NSORF=%,%";
+static const char cmdGprs[] PROGMEM = "CGATT?";
+static const char cmdRegStatus[] PROGMEM = "CEREG?";
+static const char cmdRegReports[] PROGMEM = "CEREG=1";
+static const char cmdImsi[] PROGMEM = "CIMI";
+static const char cmdImei[] PROGMEM = "CGSN=1";
+static const char cmdReboot[] PROGMEM = "NRB";
+static const char cmdRadioOn[] PROGMEM = "CFUN=1";
+static const char cmdRadioOff[] PROGMEM = "CFUN=0";
+static const char cmdReadRadio[] PROGMEM = "CFUN?";
+static const char cmdSignalStrength[] PROGMEM = "CSQ";
+static const char cmdConnectData[] PROGMEM = "CGATT=1";
+static const char cmdFirmware[] PROGMEM = "CGMR";
+static const char cmdReadApn[] PROGMEM = "CGDCONT?";
+static const char cmdSetApn[] PROGMEM = "CGDCONT=0,\"IP\",\"%\"";
+static const char cmdReadConfig[] PROGMEM = "NCONFIG?";
+static const char cmdSetAutoConnect[] PROGMEM = "NCONFIG=\"AUTOCONNECT\",\"%\"";
+static const char cmdReadOperator[] PROGMEM = "COPS?";
+static const char cmdOperatorAuto[] PROGMEM = "COPS=0";
+static const char cmdOperatorManual[] PROGMEM = "COPS=1,2,\"%%%\"";
+static const char cmdConnectionReports[] PROGMEM = "CSCON=1";
+static const char cmdRadioStats[] PROGMEM = "NUESTATS";
+static const char cmdEdrxOff[] PROGMEM = "CEDRXS=3,5";
+static const char cmdEdrxDefault[] PROGMEM = "CEDRXS=0,5";
+// Active time (T3324) as low as possible
+static const char cmdPsmOn[] PROGMEM = "CPSMS=1,,,\"01000001\",\"00000000\"";
+// Disable PSM and reset the PSM parameters to the factory values
+static const char cmdPsmReset[] PROGMEM = "CPSMS=2";
+// Baud rate and timeout, not stored on the module
+static const char cmdSetSpeed[] PROGMEM = "NATSPEED=%,%,0";
+// One line for each socket open on the module
+static const char cmdSocketStatus[] PROGMEM = "NSOSTATUS";
+
+struct command_entry {
+    const char *text;
+    uint8_t type;
+    uint16_t timeout;
+};
+
+// In the same order as at_command
+static const command_entry commandTable[] PROGMEM = {
+    { cmdErrorCodes, TelenorNBIoTBase::ct_other, DEFAULT_TIMEOUT },
+    { cmdCreateSocket, TelenorNBIoTBase::ct_nsocr, DEFAULT_TIMEOUT },
+    { cmdSendTo, TelenorNBIoTBase::ct_nsostf, DEFAULT_TIMEOUT },
+    { cmdCloseSocket, TelenorNBIoTBase::ct_nsocl, DEFAULT_TIMEOUT },
+    { cmdReceiveFrom, TelenorNBIoTBase::ct_nsorf, DEFAULT_TIMEOUT },
+    { cmdGprs, TelenorNBIoTBase::ct_cgatt, DEFAULT_TIMEOUT },
+    { cmdRegStatus, TelenorNBIoTBase::ct_cereg, DEFAULT_TIMEOUT },
+    { cmdRegReports, TelenorNBIoTBase::ct_cereg, DEFAULT_TIMEOUT },
+    { cmdImsi, TelenorNBIoTBase::ct_other, DEFAULT_TIMEOUT },
+    { cmdImei, TelenorNBIoTBase::ct_other, DEFAULT_TIMEOUT },
+    { cmdReboot, TelenorNBIoTBase::ct_nrb, REBOOT_TIMEOUT },
+    { cmdRadioOn, TelenorNBIoTBase::ct_cfun, DEFAULT_TIMEOUT },
+    { cmdRadioOff, TelenorNBIoTBase::ct_cfun, DEFAULT_TIMEOUT },
+    { cmdReadRadio, TelenorNBIoTBase::ct_cfun, DEFAULT_TIMEOUT },
+    { cmdSignalStrength, TelenorNBIoTBase::ct_csq, DEFAULT_TIMEOUT },
+    { cmdConnectData, TelenorNBIoTBase::ct_cgatt, DEFAULT_TIMEOUT },
+    { cmdFirmware, TelenorNBIoTBase::ct_other, DEFAULT_TIMEOUT },
+    { cmdReadApn, TelenorNBIoTBase::ct_cgdcont, DEFAULT_TIMEOUT },
+    { cmdSetApn, TelenorNBIoTBase::ct_cgdcont, DEFAULT_TIMEOUT },
+    { cmdReadConfig, TelenorNBIoTBase::ct_nconfig, DEFAULT_TIMEOUT },
+    { cmdSetAutoConnect, TelenorNBIoTBase::ct_nconfig, DEFAULT_TIMEOUT },
+    { cmdReadOperator, TelenorNBIoTBase::ct_cops, DEFAULT_TIMEOUT },
+    { cmdOperatorAuto, TelenorNBIoTBase::ct_cops, DEFAULT_TIMEOUT },
+    { cmdOperatorManual, TelenorNBIoTBase::ct_cops, DEFAULT_TIMEOUT },
+    { cmdConnectionReports, TelenorNBIoTBase::ct_other, DEFAULT_TIMEOUT },
+    { cmdRadioStats, TelenorNBIoTBase::ct_other, DEFAULT_TIMEOUT },
+    { cmdEdrxOff, TelenorNBIoTBase::ct_other, DEFAULT_TIMEOUT },
+    { cmdEdrxDefault, TelenorNBIoTBase::ct_other, DEFAULT_TIMEOUT },
+    { cmdPsmOn, TelenorNBIoTBase::ct_other, DEFAULT_TIMEOUT },
+    { cmdPsmReset, TelenorNBIoTBase::ct_other, DEFAULT_TIMEOUT },
+    { cmdSetSpeed, TelenorNBIoTBase::ct_other, DEFAULT_TIMEOUT },
+    { cmdSocketStatus, TelenorNBIoTBase::ct_other, DEFAULT_TIMEOUT },
+};
+
+// Names of the command types, in the same order as command_type. Used to
+// count commands sent with sendCommand().
+static const char commandNames[] PROGMEM =
+    "CFUN\0NSOSTF\0NSORF\0NSOCR\0NSOCL\0CSQ\0CEREG\0CGATT\0COPS\0CGDCONT\0NCONFIG\0NRB\0";
+
+const TelenorNBIoTBase::power_profile TelenorNBIoTBase::defaultPowerProfile = { 200, 40, 6, 1000, 20000 };
+
+TelenorNBIoTBase::TelenorNBIoTBase(char *buffer, uint16_t bufferSize, char **lines, uint8_t maxLines,
+    socket_state *sockets, uint8_t maxSockets,
+    const char *accessPointName, uint16_t mobileCountryCode, uint16_t mobileNetworkCode)
+    : buffer(buffer), _bufferSize(bufferSize), lines(lines), _maxLines(maxLines),
+      _sockets(sockets), _maxSockets(maxSockets)
 {
+    // The sockets are closed when they are created
     _socket = -1;
     memset(_imei, 0, 16);
     memset(_imsi, 0, 16);
 
     mcc = mobileCountryCode;
     mnc = mobileNetworkCode;
-    strcpy(apn, accessPointName.c_str());
+    strncpy(apn, accessPointName, sizeof(apn) - 1);
+    apn[sizeof(apn) - 1] = 0;
 }
 
-bool TelenorNBIoT::begin(Stream &serial, bool _debug)
+bool TelenorNBIoTBase::begin(Stream &serial, bool _debug, bool warmStart)
 {
     debug = _debug;
     if (debug) {
-        Serial.println("NB-IoT debug enabled");
+        Serial.println(F("NB-IoT debug enabled"));
     }
     //Stream &serial
     ublox = &serial;
-    // Increase timeout for the module. It might be slow to respond on certain
-    // commands.
-    ublox->setTimeout(DEFAULT_TIMEOUT);
     while (!ublox) {}
-    drain();
-    setAutoConnect(false);
-    reboot();
-
-    return online() &&
-        setNetworkOperator(mcc, mnc) &&
-        ensureAccessPointName(apn);
-}
+    _cmdStatus = cmd_idle;
+    _tokenizer.reset();
+    processInput();
+    findSpeed();
 
-bool TelenorNBIoT::enableErrorCodes()
-{
-    // Enable error codes for u-blox SARA N2 errors
-    return retry(10, [this]() {
-        writeCommand("CMEE=1");
-        return readCommand(lines) == 1 && isOK(lines[0]);
-    });
-}
+    bool ready = warmStart && resume();
+    if (!ready)
+    {
+        setAutoConnect(false);
+        reboot();
 
-bool TelenorNBIoT::setNetworkOperator(uint8_t mobileCountryCode, uint8_t mobileNetworkCode)
-{
-    if (mobileCountryCode > 0 && mobileNetworkCode > 0) {
-        char buffer[40];
-        sprintf(buffer, "COPS=1,2,\"%d%02d\"", mobileCountryCode, mobileNetworkCode);
-        writeCommand(buffer);
-    } else {
-        writeCommand("COPS=0");
+        ready = online() &&
+            setNetworkOperator(mcc, mnc) &&
+            ensureAccessPointName(apn);
     }
-    return readCommand(lines) == 1 && isOK(lines[0]);
-}
-
-bool TelenorNBIoT::ensureAccessPointName(const char *accessPointName)
-{
-    char *currentAPN = readAccessPointName();
-    if (currentAPN != NULL && strcmp(currentAPN, accessPointName) == 0)
+    if (ready && _maintain)
     {
-        return true;
+        // The reboot turned off the registration status reports
+        ready = maintainConnection(_attachTimeout, _minBackoff, _maxBackoff);
     }
-    return setAccessPointName(accessPointName);
+    if (ready && _serialSpeed != _speed)
+    {
+        // Stays at the default speed if it fails
+        negotiateSpeed();
+    }
+    return ready;
 }
 
-char* TelenorNBIoT::readAccessPointName()
+void TelenorNBIoTBase::findSpeed()
 {
-    writeCommand(READ_APN);
-    int count = readCommand(lines);
-    if (!isOK(lines[count-1]))
+    if (!_speedCallback)
     {
-        return NULL;
+        // The sketch has started the serial port at the default speed
+        _serialSpeed = DEFAULT_SPEED;
+        return;
     }
-
-    // We only care about context ID 0, but the contexts might be out of order,
-    // so we have too loop through all to make sure we find it.
-    for (uint8_t i=0; i<count-1; i++)
+    // Try the speed used last, the default speed and the new speed. The
+    // module keeps the speed when the board restarts without it.
+    const uint32_t speeds[] = { _serialSpeed, DEFAULT_SPEED, _speed };
+    for (uint8_t i = 0; i < 3; i++)
     {
-        // +CGDCONT: 0,"IP","mda.ee",,0,0,,,,,1
-        char* fields[3];
-        if (splitFields(lines[i] + 10, fields, 3) >=3)
+        if (i > 0 && (speeds[i] == speeds[0] || speeds[i] == speeds[i - 1]))
         {
-            int contextId = atoi(fields[0]);
-            char* apn = fields[2];
-            
-            if (contextId == 0)
-            {
-                return apn;
-            }
+            continue;
+        }
+        changeSpeed(speeds[i]);
+        writeCommand(at_error_codes);
+        if (readCommand() == cmd_ok)
+        {
+            return;
         }
     }
-
-    return NULL;
+    changeSpeed(DEFAULT_SPEED);
 }
 
-bool TelenorNBIoT::setAccessPointName(const char *accessPointName)
+bool TelenorNBIoTBase::negotiateSpeed()
 {
-    if (strlen(accessPointName) == 0)
+    writeCommand(at_set_speed, _speed, SPEED_TIMEOUT);
+    if (readCommand() != cmd_ok)
     {
-        // If the APN is blank, don't override the network default PDP context
-        return true;
+        // Not a speed the module supports
+        return false;
     }
+    uint32_t previous = _serialSpeed;
+    changeSpeed(_speed);
 
-    return retry(3, [this, accessPointName]() {
-        sprintf(buffer, SET_APN, 0, accessPointName);
-        writeCommand(buffer);
-        return readCommand(lines) == 1 && isOK(lines[0]);
-    });
-}
-
-bool TelenorNBIoT::setAutoConnect(bool enabled)
-{
-    sprintf(buffer, CONFIG_AUTOCONN, enabled ? "TRUE" : "FALSE");
-    writeCommand(buffer);
-    return readCommand(lines) == 1 && isOK(lines[0]);
-}
-
-bool TelenorNBIoT::dataOn()
-{
-    writeCommand(CONNECT_DATA);
-    if (readCommand(lines) == 1 && isOK(lines[0]))
+    // The module goes back to the previous speed if no command gets through
+    // before the timeout, so there's only time for one attempt
+    writeCommand(at_error_codes);
+    if (readCommand() == cmd_ok)
     {
+        if (debug) Serial.println(F("Serial speed changed"));
         return true;
     }
+    changeSpeed(previous);
+    delay(SPEED_TIMEOUT * 1000UL);
+    enableErrorCodes();
     return false;
 }
 
-bool TelenorNBIoT::isConnected()
+void TelenorNBIoTBase::changeSpeed(uint32_t baudRate)
 {
-    writeCommand(GPRS);
-    if (readCommand(lines) == 2 && isOK(lines[1]))
+    if (baudRate == _serialSpeed || !_speedCallback)
     {
-        // Line contains "+CGATT: <1:available, 0:not available"
-        // The GPRS status isn't strictly the online/offline indicator but
-        // reasonable close. It will be available if the module is online
-        return (*(lines[0] + 8) == '1');
+        return;
     }
-    return false;
+    // Let the last command go out at the old speed
+    ublox->flush();
+    _speedCallback(baudRate);
+    _serialSpeed = baudRate;
 }
 
-TelenorNBIoT::registrationStatus_t TelenorNBIoT::registrationStatus()
+void TelenorNBIoTBase::setSerialSpeed(uint32_t baudRate, speed_callback callback)
 {
-    int statusNum = -1;
-    writeCommand(REG_STATUS);
-    if (readCommand(lines) == 2 && isOK(lines[1]))
-    {
-        // Line contains "+CEREG: <n>,<status>"
-        statusNum = atoi((lines[0] + 10));
-    }
-    
-    if (statusNum == 0) {
-        return RS_NOT_REGISTERED;
-    } else if (statusNum == 1) {
-        return RS_REGISTERED;
-    } else if (statusNum == 2) {
-        return RS_REGISTERING;
-    } else if (statusNum == 3) {
-        return RS_DENIED;
-    }
-    return RS_UNKNOWN;
+    _speed = baudRate;
+    _speedCallback = nonstd::move(callback);
 }
 
-bool TelenorNBIoT::isRegistered()
+uint32_t TelenorNBIoTBase::serialSpeed()
 {
-    return registrationStatus() == RS_REGISTERED;
+    return _serialSpeed;
 }
 
-bool TelenorNBIoT::isRegistering()
+bool TelenorNBIoTBase::enableErrorCodes()
 {
-    return registrationStatus() == RS_REGISTERING;
+    // Enable error codes for u-blox SARA N2 errors
+    return retry(10, [this]() {
+        writeCommand(at_error_codes);
+        return readCommand() == cmd_ok;
+    });
 }
 
-String TelenorNBIoT::imei()
+bool TelenorNBIoTBase::resume()
 {
-    if (strnlen(_imei, sizeof _imei) != 15)
-    {
-        retry(10, [this]() {
-            writeCommand(IMEI);
-            if (readCommand(lines) == 2 && isOK(lines[1]))
+    // Everything the warm start depends on is read with one command line.
+    // The socket status comes last, as not all firmware versions have it.
+    const at_command queries[] = {
+        at_error_codes, at_read_config, at_read_radio, at_read_operator,
+        at_read_apn, at_reg_status, at_socket_status
+    };
+    struct {
+        bool autoConnect = false;
+        bool autoConnectDisabled = false;
+        int radio = -1;
+        int operatorMode = -1;
+        uint32_t networkOperator = 0;
+        bool accessPointName = false;
+        int registration = -1;
+        uint8_t openSockets = 0;
+    } state;
+    auto parse = [this, &state](const ATTokenizer &response) {
+        if (response.hasPrefix("+NCONFIG"))
+        {
+            // One line for each setting, f.e. +NCONFIG: "AUTOCONNECT","FALSE"
+            if (response.index() == 0)
             {
-                // Line 1 contains IMEI ("+CGSN: <15-digit IMEI>")
-                char *ptr = lines[0] + 7;
-                if (strnlen(ptr, 16) == 15) {
-                    memcpy(_imei, ptr, 16);
-                    return true;
-                }
+                state.autoConnect = strcmp(response.text(), "AUTOCONNECT") == 0;
             }
-            
-            return false;
-        });
+            else if (response.index() == 1 && state.autoConnect)
+            {
+                state.autoConnectDisabled = strcmp(response.text(), "FALSE") == 0;
+            }
+        }
+        else if (response.hasPrefix("+CFUN") && response.index() == 0)
+        {
+            state.radio = response.value();
+        }
+        else if (response.hasPrefix("+COPS"))
+        {
+            // "+COPS: <mode>[,<format>,"<operator>"]"
+            if (response.index() == 0)
+            {
+                state.operatorMode = response.value();
+            }
+            else if (response.index() == 2)
+            {
+                state.networkOperator = strtoul(response.text(), NULL, 10);
+            }
+        }
+        else if (response.hasPrefix("+CGDCONT") && response.index() == 2 && response.value(0) == 0)
+        {
+            state.accessPointName = strcmp(response.text(), apn) == 0;
+        }
+        else if (response.hasPrefix("+CEREG") && response.index() == 1)
+        {
+            state.registration = response.value();
+        }
+        else if (response.hasPrefix("+NSOSTATUS") && response.index() == 0 && response.value() < MAXSOCKETS)
+        {
+            state.openSockets |= 1 << response.value();
+        }
+    };
+
+    const uint8_t count = sizeof(queries) / sizeof(queries[0]);
+    command_status status = cmd_ok;
+    if (!_separateQueries)
+    {
+        writeQueries(queries, count);
+        status = readCommand(parse);
+        if (status == cmd_error && state.registration < 0)
+        {
+            // Try one at a time, and keep doing that, like readStatus()
+            _separateQueries = true;
+            status = cmd_ok;
+        }
+    }
+    if (_separateQueries)
+    {
+        for (uint8_t i = 0; i < count && status == cmd_ok; i++)
+        {
+            writeCommand(queries[i]);
+            status = readCommand(parse);
+        }
     }
-    return String(_imei);
-}
 
-String TelenorNBIoT::imsi()
-{
-    if (strnlen(_imsi, sizeof _imsi) != 15)
+    // The module must respond, and must not attach by itself, or it is
+    // rebooted like in a cold start. An error after the registration status
+    // means the socket status isn't supported.
+    bool socketsListed = status == cmd_ok;
+    if (!socketsListed && !(status == cmd_error && state.registration >= 0))
     {
-        retry(10, [this]() {
-            writeCommand(IMSI);
-            if (readCommand(lines) == 2 && isOK(lines[1]) && strnlen(lines[0], 16) == 15)
-            {
-                // Line contains IMSI ("<15 digit IMSI>")
-                memcpy(_imsi, lines[0], strnlen(lines[0], 15) + 1);
-                return true;
-            }
-            return false;
-        });
+        return false;
+    }
+    _regStatus = parseRegistrationStatus(state.registration);
+    if (!state.autoConnectDisabled || _regStatus == RS_DENIED)
+    {
+        return false;
     }
-    return String(_imsi);
-}
 
-bool TelenorNBIoT::createSocket(const uint16_t listenPort)
-{
-    if (_socket == -1)
+    if (debug) Serial.println(F("Module is configured, skipping reboot"));
+
+    // Close the sockets opened before the board restarted. Without the
+    // socket status, only the ones opened since then are known.
+    if (!socketsListed)
     {
-        sprintf(buffer, SOCR, listenPort);
-        writeCommand(buffer);
-        if (readCommand(lines) == 2 && isOK(lines[1]))
+        for (uint8_t socket = 0; socket < _maxSockets; socket++)
         {
-            _socket = atoi(lines[0]);
-            return true;
+            if (_sockets[socket].open && _sockets[socket].id >= 0)
+            {
+                state.openSockets |= 1 << _sockets[socket].id;
+            }
         }
     }
-    return false;
-}
-
-bool TelenorNBIoT::closeSocket()
-{
-    if (_socket > -1)
+    resetSockets();
+    for (uint8_t id = 0; id < MAXSOCKETS; id++)
     {
-        sprintf(buffer, SOCL, _socket);
-        writeCommand(buffer);
-        if (readCommand(lines) == 1 && isOK(lines[0]))
+        if (state.openSockets & (1 << id))
         {
-            _socket = -1;
-            return true;
+            writeCommand(at_close_socket, id);
+            readCommand();
         }
     }
-    return false;
-}
 
-bool TelenorNBIoT::reboot()
-{
-    _socket = -1;
-    return retry(3, [this]() {
-        writeCommand(REBOOT);
-        delay(2000);
-        int ret = readCommand(lines);
-        return ret > 0 && isOK(lines[ret - 1]);
-    }) && enableErrorCodes();
+    return (state.radio == 1 || online()) &&
+        (isNetworkOperator(state.operatorMode, state.networkOperator, mcc, mnc) || setNetworkOperator(mcc, mnc)) &&
+        (state.accessPointName || setAccessPointName(apn));
 }
 
-bool TelenorNBIoT::online()
+bool TelenorNBIoTBase::isNetworkOperator(int mode, uint32_t networkOperator, uint16_t mobileCountryCode, uint16_t mobileNetworkCode)
 {
-    writeCommand(RADIO_ON);
-    return readCommand(lines) == 1 && isOK(lines[0]);
+    if (mobileCountryCode > 0 && mobileNetworkCode > 0)
+    {
+        // The operator is the MCC followed by a two or three digit MNC
+        uint32_t expected = (uint32_t)mobileCountryCode * (mobileNetworkCode < 100 ? 100 : 1000) + mobileNetworkCode;
+        return mode == 1 && networkOperator == expected;
+    }
+    return mode == 0;
 }
 
-bool TelenorNBIoT::offline()
+bool TelenorNBIoTBase::setNetworkOperator(uint8_t mobileCountryCode, uint8_t mobileNetworkCode)
 {
-    writeCommand(RADIO_OFF);
-    return readCommand(lines) == 1 && isOK(lines[0]);
+    writeNetworkOperator(mobileCountryCode, mobileNetworkCode);
+    return readCommand() == cmd_ok;
 }
 
-int TelenorNBIoT::rssi()
+void TelenorNBIoTBase::writeNetworkOperator(uint16_t mobileCountryCode, uint16_t mobileNetworkCode)
 {
-    int rssi = 99;
-    writeCommand(SIGNAL_STRENGTH);
-    int ret = readCommand(lines);
-    if (ret != 2 || !isOK(lines[1]))
-    {
-        return rssi;
-    }
-    char* fields[2];
-    int found = splitFields(lines[0] + 6, fields, 2);
-    if (found != 1)
-    {
-        return rssi;
-    }
-    rssi = atoi(fields[0]);
-    if (rssi == 99) {
-      return rssi;
+    if (mobileCountryCode > 0 && mobileNetworkCode > 0) {
+        // The MNC has at least two digits
+        writeCommand(at_operator_manual, mobileCountryCode, mobileNetworkCode < 10 ? "0" : "", mobileNetworkCode);
+    } else {
+        writeCommand(at_operator_auto);
     }
-    return -113 + rssi * 2;
-}
-
-int TelenorNBIoT::errorCode()
-{
-    return _errCode;
 }
 
-String TelenorNBIoT::firmwareVersion()
+bool TelenorNBIoTBase::ensureAccessPointName(const char *accessPointName)
 {
-    writeCommand(FIRMWARE);
-    int ret = readCommand(lines);
-    if (ret != 2 || !isOK(lines[1]))
+    if (isAccessPointName(accessPointName))
     {
-        return "ERROR";
+        return true;
     }
-    return String(lines[0]);
+    return setAccessPointName(accessPointName);
 }
 
-void TelenorNBIoT::writeBuffer(const char *data, uint16_t length)
+bool TelenorNBIoTBase::isAccessPointName(const char *accessPointName)
 {
-    for (int i = 0; i < length; i++)
-    {
-        unsigned char ch1 = (data[i] & 0xF0) >> 4;
-        unsigned char ch2 = (data[i] & 0x0F);
-        if (ch1 <= 9)
-        {
-            ch1 = (char)('0' + ch1);
-        }
-        else
-        {
-            ch1 = (char)('A' + ch1 - 10);
-        }
-        if (ch2 <= 9)
-        {
-            ch2 = (char)('0' + ch2);
-        }
-        else
+    writeCommand(at_read_apn);
+    // We only care about context ID 0, but the contexts might be out of order,
+    // so we have too look at all of them to make sure we find it.
+    // +CGDCONT: 0,"IP","mda.ee",,0,0,,,,,1
+    bool found = false;
+    command_status status = readCommand([accessPointName, &found](const ATTokenizer &response) {
+        if (response.hasPrefix("+CGDCONT") && response.index() == 2 && response.value(0) == 0)
         {
-            ch2 = (char)('A' + ch2 - 10);
+            found = strcmp(response.text(), accessPointName) == 0;
         }
-        ublox->write(ch1);
-        ublox->write(ch2);
-    }
+    });
+    return status == cmd_ok && found;
 }
 
-bool TelenorNBIoT::sendTo(const char *ip, const uint16_t port, const char *data, const uint16_t length)
+bool TelenorNBIoTBase::setAccessPointName(const char *accessPointName)
 {
-    ublox->print(PREFIX);
-    ublox->print(SOSTF);
-    ublox->print(_socket);
-    ublox->print(",\"");
-    ublox->print(ip);
-    ublox->print("\",");
-    ublox->print(port);
-    ublox->print(",");
-    
-    if (m_psm == psm_always_on) {
-        ublox->print("0x000");
-    } else if (m_psm == psm_sleep_after_send) {
-        ublox->print("0x200");
-    } else if (m_psm == psm_sleep_after_response) {
-        ublox->print("0x400");
-    }
-
-    ublox->print(",");
-    ublox->print(length);
-    ublox->print(",\"");
-
-    writeBuffer(data, length);
-
-    ublox->print("\"");
-    ublox->print(POSTFIX);
-
-    if (readCommand(lines) == 2 && isOK(lines[1]))
+    if (strlen(accessPointName) == 0)
     {
-        char *fields[10];
-        int count = splitFields(lines[0], fields, 10);
-        if (count == 2)
-        {
-            // Found two fields. First is socket no
-            uint16_t socketNo = atoi(fields[0]);
-            uint16_t bytes = atoi(fields[1]);
-            if (socketNo == _socket && bytes == length)
-            {
-                return true;
-            }
-        }
+        // If the APN is blank, don't override the network default PDP context
+        return true;
     }
-    return false;
-}
 
-bool TelenorNBIoT::sendBytes(IPAddress remoteIP, const uint16_t port, const char *data, const uint16_t length)
-{
-    memcpy(buffer, data, length);
-    char ip[16];
-    sprintf(ip, "%d.%d.%d.%d", remoteIP[0], remoteIP[1], remoteIP[2], remoteIP[3]);
-    return sendTo(ip, port, buffer, length);
+    return retry(3, [this, accessPointName]() {
+        writeCommand(at_set_apn, accessPointName);
+        return readCommand() == cmd_ok;
+    });
 }
 
-bool TelenorNBIoT::sendString(IPAddress remoteIP, const uint16_t port, String str)
+bool TelenorNBIoTBase::setAutoConnect(bool enabled)
 {
-    return sendBytes(remoteIP, port, str.c_str(), str.length());
+    writeCommand(at_set_autoconnect, enabled ? "TRUE" : "FALSE");
+    return readCommand() == cmd_ok;
 }
 
-size_t TelenorNBIoT::receiveBytes(char *outbuf, uint16_t bufferLength)
+bool TelenorNBIoTBase::dataOn()
 {
-    sprintf(buffer, RECVFROM, _socket, bufferLength);
-    writeCommand(buffer);
-    if (readCommand(lines) == 2 && isOK(lines[1]))
-    {
-        // Fields should be <socket>,<ip>,<port>,<length>,<data>,<remaining length>
-        char *fields[10];
-        int found = splitFields(lines[0], fields, 10);
-        if (found == 6)
-        {
-            _receivedFromIP.fromString(fields[1]);
-            _receivedFromPort = atoi(fields[2]);
-            size_t readLength = atoi(fields[3]);
-            hexToBytes(fields[4], readLength, outbuf);
-            _receivedBytesRemaining = atoi(fields[5]);
-            return readLength;
-        }
-    }
-    return 0;
+    writeCommand(at_connect_data);
+    return readCommand() == cmd_ok;
 }
 
-size_t TelenorNBIoT::receivedBytesRemaining()
+bool TelenorNBIoTBase::isConnected()
 {
-    return _receivedBytesRemaining;
+    writeCommand(at_gprs);
+    // Line contains "+CGATT: <1:available, 0:not available"
+    // The GPRS status isn't strictly the online/offline indicator but
+    // reasonable close. It will be available if the module is online
+    readValue("+CGATT", 0);
+    return readCommand() == cmd_ok && _responseValue == 1;
 }
 
-IPAddress TelenorNBIoT::receivedFromIP()
+TelenorNBIoTBase::registrationStatus_t TelenorNBIoTBase::registrationStatus()
 {
-    return _receivedFromIP;
+    int statusNum = -1;
+    writeCommand(at_reg_status);
+    // Line contains "+CEREG: <n>,<status>"
+    readValue("+CEREG", 1);
+    if (readCommand() == cmd_ok)
+    {
+        statusNum = _responseValue;
+    }
+    _regStatus = parseRegistrationStatus(statusNum);
+    return _regStatus;
 }
 
-uint16_t TelenorNBIoT::receivedFromPort()
+TelenorNBIoTBase::registrationStatus_t TelenorNBIoTBase::parseRegistrationStatus(int status)
 {
-    return _receivedFromPort;
+    if (status == 0) {
+        return RS_NOT_REGISTERED;
+    } else if (status == 1 || status == 5) {
+        // Registered on the home network or roaming
+        return RS_REGISTERED;
+    } else if (status == 2) {
+        return RS_REGISTERING;
+    } else if (status == 3) {
+        return RS_DENIED;
+    }
+    return RS_UNKNOWN;
 }
 
-bool TelenorNBIoT::powerSaveMode(power_save_mode psm)
+bool TelenorNBIoTBase::maintainConnection(unsigned long attachTimeout, unsigned long minBackoff, unsigned long maxBackoff)
 {
-    m_psm = psm;
-
-    if (m_psm == psm_sleep_after_send || m_psm == psm_sleep_after_response)
+    // Have the module report changes to the registration status
+    writeCommand(at_reg_reports);
+    if (readCommand() != cmd_ok)
     {
-        // disable eDRX
-        writeCommand("CEDRXS=3,5");
-
-        // enable Power Save Mode and set active time to as low as possible
-        // mode (0 - disable PSM, 1 - enable PSM, 2 - disable PSM and reset all params)
-        // Requested Periodic RAU (N/A)
-        // Requested GPRS READY timer (N/A)
-        // Requested Periodic TAU (T3412) - 
-        // Requested Active Time (T3324) - 
-        writeCommand("CPSMS=1,,,\"01000001\",\"00000000\"");
-        return (readCommand(lines) == 1 && isOK(lines[0]));
+        return false;
     }
-    else
+    if (readImei())
     {
-        // set eDRX to default value
-        writeCommand("CEDRXS=0,5");
-        if (readCommand(lines) != 1 || !isOK(lines[0]))
+        // Mix the IMEI into the random number generator, so devices that
+        // lost the network at the same time wait different backoffs
+        unsigned long seed = random(0x7FFFFFFF);
+        for (const char *digit = _imei; *digit != '\0'; digit++)
         {
-            return false;
+            seed = seed * 31 + *digit;
         }
-
-        // disable Power Save Mode and reset all PSM parameters to factory values
-        writeCommand("CPSMS=2");
-        return (readCommand(lines) == 1 && isOK(lines[0]));
+        randomSeed(seed);
     }
+    _maintain = true;
+    _attachTimeout = attachTimeout;
+    _minBackoff = minBackoff > 0 ? minBackoff : 1;
+    _maxBackoff = maxBackoff > _minBackoff ? maxBackoff : _minBackoff;
+    _attempts = 0;
+    _regStatus = RS_UNKNOWN;
+    setConnectionState(cs_attaching);
+    return true;
 }
 
-bool TelenorNBIoT::isOK(const char *line)
+void TelenorNBIoTBase::stopMaintainingConnection()
 {
-    return (line[0] == 'O' && line[1] == 'K');
+    _maintain = false;
+    setConnectionState(cs_offline);
 }
 
-bool TelenorNBIoT::isError(const char *line)
+TelenorNBIoTBase::connection_state TelenorNBIoTBase::connectionState()
 {
-    int i = 0;
-    if (line[i] == '+') {
-        i = 5;
-    }
-    return (line[i++] == 'E' && line[i++] == 'R' && line[i++] == 'R' && line[i++] == 'O' && line[i++] == 'R');
+    return _connState;
 }
 
-int TelenorNBIoT::parseErrorCode(const char *line)
+void TelenorNBIoTBase::setConnectionState(connection_state state)
 {
-    if (!isError(line)) {
-        return -1;
-    } else if (line[0] != '+') {
-        return -2;
+    if (debug) {
+        Serial.print(F("Connection state: "));
+        Serial.println(state);
     }
-    line += 12;
-    int errCode = atoi(line);
-    return errCode;
+    _connState = state;
+    _stateSince = millis();
+    // Check right away in the new state
+    _lastRegCheck = _stateSince - REG_CHECK_INTERVAL;
 }
 
-void TelenorNBIoT::hexToBytes(const char *hex, const uint16_t byte_count, char *bytes)
+void TelenorNBIoTBase::updateConnection()
 {
-    const uint16_t hex_count = byte_count*2;
-    for (int i=0; i<hex_count; i++) {
-        char c = hex[i];
-        if (c >= 48 && c <= 57) {
-            c -= 48;
-        } else if (c >= 65 && c <= 70) {
-            c -= 55;
-        } else if (c >= 97 && c <= 102) {
-            c -= 87;
-        } else {
-            c = 0;
+    if (!_maintain || _cmdStatus == cmd_pending)
+    {
+        return;
+    }
+
+    unsigned long now = millis();
+    switch (_connState)
+    {
+    case cs_attaching:
+        if (_regStatus == RS_REGISTERED)
+        {
+            _attempts = 0;
+            // Send the queued datagrams right away
+            _replayWait = false;
+            setConnectionState(cs_connected);
+        }
+        else if (_regStatus == RS_DENIED || now - _stateSince > _attachTimeout)
+        {
+            startBackoff();
+        }
+        else if (now - _lastRegCheck >= REG_CHECK_INTERVAL)
+        {
+            // The module reports changes, but ask in case a report was missed
+            _lastRegCheck = now;
+            writeCommand(at_reg_status);
+            // Line contains "+CEREG: <n>,<status>"
+            readValue("+CEREG", 1);
+            _cmdCallback = [this](command_status status, uint8_t lineCount, char **lines) {
+                if (status == cmd_ok && _responseValue >= 0)
+                {
+                    _regStatus = parseRegistrationStatus(_responseValue);
+                }
+            };
+        }
+        break;
+
+    case cs_connected:
+        if (_regStatus != RS_REGISTERED)
+        {
+            // Give the module the chance to attach again by itself first
+            setConnectionState(cs_attaching);
+        }
+        else if (now - _lastRegCheck >= REG_CHECK_INTERVAL)
+        {
+            _lastRegCheck = now;
+            reopenSockets();
         }
+        break;
 
-        if (i%2 == 0) {
-            bytes[i/2] = c << 4;
-        } else {
-            bytes[i/2] += c;
+    case cs_backoff:
+        if (now - _stateSince >= _backoffDelay)
+        {
+            _recoveryStep = 0;
+            setConnectionState(cs_recovering);
         }
+        break;
+
+    case cs_recovering:
+        recover();
+        break;
+
+    default:
+        break;
     }
 }
 
-void TelenorNBIoT::drain()
+void TelenorNBIoTBase::startBackoff()
 {
-    if (ublox->available()) {
-        if (debug) Serial.println("---DRAINING---");
-        while(ublox->available()) {
-            char c = ublox->read();
-            if (debug) Serial.print(c);
-        }
-        if (debug) Serial.println("--------------");
+    unsigned long backoff = _minBackoff;
+    for (uint8_t i = 0; i < _attempts && backoff < _maxBackoff; i++)
+    {
+        backoff = backoff > _maxBackoff / 2 ? _maxBackoff : backoff * 2;
+    }
+    // Wait a random part of the backoff as well, so devices that lost the
+    // network at the same time spread out instead of trying together
+    _backoffDelay = backoff / 2 + random(backoff / 2 + 1);
+    if (_attempts < 255)
+    {
+        _attempts++;
     }
+    setConnectionState(cs_backoff);
 }
 
-uint8_t TelenorNBIoT::readCommand(char **lines)
+void TelenorNBIoTBase::recover()
 {
-    uint8_t read = 1;
-    uint8_t lineno = 0;
-    uint8_t offset = 0;
-    bool completed = false;
-    drain();
-    while (read > 0 && !completed && lineno < MAXLINES)
+    // Reboot and configure the module like begin() does, one command at a
+    // time so poll() doesn't block while the module reboots. The APN is
+    // kept by the module.
+    switch (_recoveryStep)
     {
-        read = ublox->readBytesUntil('\n', (buffer + offset), (BUFSIZE - offset));
-        if (read == 1 && buffer[offset] == '\r')
+    case 0:
+        loseSockets();
+        _regStatus = RS_UNKNOWN;
+        writeCommand(at_reboot);
+        changeSpeed(DEFAULT_SPEED);
+        break;
+    case 1:
+        writeCommand(at_error_codes);
+        break;
+    case 2:
+        writeCommand(at_radio_on);
+        break;
+    case 3:
+        writeNetworkOperator(mcc, mnc);
+        break;
+    case 4:
+        writeCommand(at_reg_reports);
+        break;
+    case 5:
+        if (_serialSpeed != _speed)
         {
-                offset += 1;
+            writeCommand(at_set_speed, _speed, SPEED_TIMEOUT);
+            break;
         }
-        else if (read > 0)
+        setConnectionState(cs_attaching);
+        return;
+    case 6:
+        // Check the link at the new speed
+        writeCommand(at_error_codes);
+        break;
+    default:
+        setConnectionState(cs_attaching);
+        return;
+    }
+    _cmdCallback = [this](command_status status, uint8_t lineCount, char **lines) {
+        if (status == cmd_ok)
         {
-            lines[lineno] = (buffer + offset);
-            if (buffer[offset + read - 1] == '\r')
+            if (_recoveryStep == 5)
             {
-                // replace carrige-return with string terminator
-                buffer[offset + read - 1] = 0;
-                offset += (read);
-            } else {
-                // insert string terminator after last read char
-                buffer[offset + read] = 0;
-                offset += (read + 1);
+                changeSpeed(_speed);
             }
-
-            if (debug) {
-                Serial.print("Response line: ");
-                Serial.println(lines[lineno]);
-            }
-            
-            
-            // Exit if line is "OK" - this is the end of the response
-            if (isOK(lines[lineno]))
-            {
-                completed = true;
-            }
-            // ...or if line is "ERROR"
-            if (isError(lines[lineno]))
-            {
-                completed = true;
-                _errCode = parseErrorCode(lines[lineno]);
-            }
-
-            lineno++;
+            _recoveryStep++;
         }
-        
-    }
-    return lineno;
+        else if (_recoveryStep >= 5)
+        {
+            // Carry on at the default speed. The module goes back to it by
+            // itself after SPEED_TIMEOUT.
+            changeSpeed(DEFAULT_SPEED);
+            _recoveryStep = 7;
+        }
+        else
+        {
+            startBackoff();
+        }
+    };
 }
 
-void TelenorNBIoT::writeCommand(const char *cmd)
+bool TelenorNBIoTBase::isRegistered()
 {
-    uint8_t n = 0;
-    drain();
-    _errCode = -1;
+    return registrationStatus() == RS_REGISTERED;
+}
 
-    if (debug) {
-        Serial.print("Write command: ");
-        Serial.print(PREFIX);
-        Serial.println(cmd);
-    }
-    
-    ublox->print(PREFIX);
-    ublox->print(cmd);
-    ublox->print(POSTFIX);
+bool TelenorNBIoTBase::isRegistering()
+{
+    return registrationStatus() == RS_REGISTERING;
 }
 
 /**
- * Splits a comma separated and null terminated response line from u-blox.
- * Line should be a pointer to the first character of the first field (not
- * the beginning of the line). It will modify the input line by replacing
- * comma and double quotes with `\0`. Each field will point to the first
- * character of each field. Returns the number of found fields.
+ * Copy a string to a buffer of the given size, including the terminating
+ * zero. Returns false if it doesn't fit.
  */
-int splitFields(char *line, char **fields, uint8_t maxFields)
-{
-    fields[0] = line;
-    int found = 1;
-    for(char *p = line; *p != '\0'; p++) {
-        if (*p == '"')
-        {
-            // replace double-quote with null-terminator
-            *p = '\0';
-            
-            // if opening quote - move pointer one ahead
-            int current = found-1;
-            if (p == fields[current])
-            {
-                fields[current] = p + 1;
-            }
-        }
-        else if (*p == ',')
-        {
-            *p = '\0';
-            if (found < maxFields)
-            {
-                fields[found++] = p + 1;
-            }
-        }
+static bool copyTo(char *buffer, size_t size, const char *value)
+{
+    size_t length = strlen(value);
+    if (buffer == NULL || length >= size)
+    {
+        return false;
     }
-    return found;
+    memcpy(buffer, value, length + 1);
+    return true;
 }
 
-bool retry(uint8_t attempts, nonstd::function<bool ()> fn, uint16_t delayBetween)
+bool TelenorNBIoTBase::imei(char *buffer, size_t size)
 {
-    while (attempts--)
-    {
-        if (fn()) {
-            return true;
-        }
-        delay(delayBetween);
-    }
-    return false;
+    return readImei() && copyTo(buffer, size, _imei);
+}
+
+bool TelenorNBIoTBase::imsi(char *buffer, size_t size)
+{
+    return readImsi() && copyTo(buffer, size, _imsi);
+}
+
+#ifndef NBIOT_NO_STRING
+String TelenorNBIoTBase::imei()
+{
+    readImei();
+    return String(_imei);
+}
+
+String TelenorNBIoTBase::imsi()
+{
+    readImsi();
+    return String(_imsi);
+}
+#endif
+
+bool TelenorNBIoTBase::readImei()
+{
+    if (strnlen(_imei, sizeof _imei) == 15)
+    {
+        return true;
+    }
+    return retry(10, [this]() {
+        writeCommand(at_imei);
+        // Line 1 contains IMEI ("+CGSN: <15-digit IMEI>")
+        command_status status = readCommand([this](const ATTokenizer &response) {
+            if (response.hasPrefix("+CGSN") && strlen(response.text()) == 15)
+            {
+                memcpy(_imei, response.text(), 16);
+            }
+        });
+        return status == cmd_ok && strnlen(_imei, sizeof _imei) == 15;
+    });
+}
+
+bool TelenorNBIoTBase::readImsi()
+{
+    if (strnlen(_imsi, sizeof _imsi) == 15)
+    {
+        return true;
+    }
+    return retry(10, [this]() {
+        writeCommand(at_imsi);
+        // Line contains IMSI ("<15 digit IMSI>")
+        command_status status = readCommand([this](const ATTokenizer &response) {
+            if (response.hasPrefix("") && strlen(response.text()) == 15)
+            {
+                memcpy(_imsi, response.text(), 16);
+            }
+        });
+        return status == cmd_ok && strnlen(_imsi, sizeof _imsi) == 15;
+    });
+}
+
+bool TelenorNBIoTBase::readStatus(module_status &status, unsigned long maxAge)
+{
+    // The IMEI and IMSI may have been read already
+    if (status.imei[0] == 0 && strnlen(_imei, sizeof _imei) == 15)
+    {
+        memcpy(status.imei, _imei, sizeof _imei);
+    }
+    if (status.imsi[0] == 0 && strnlen(_imsi, sizeof _imsi) == 15)
+    {
+        memcpy(status.imsi, _imsi, sizeof _imsi);
+    }
+
+    at_command queries[5];
+    uint8_t count = 0;
+    if (status.imei[0] == 0)
+    {
+        queries[count++] = at_imei;
+    }
+    if (status.imsi[0] == 0)
+    {
+        queries[count++] = at_imsi;
+    }
+    if (status.firmware[0] == 0)
+    {
+        queries[count++] = at_firmware;
+    }
+    if (status.registration == RS_UNKNOWN || millis() - status.updated >= maxAge)
+    {
+        queries[count++] = at_signal_strength;
+        queries[count++] = at_reg_status;
+        status.rssi = 99;
+        status.registration = RS_UNKNOWN;
+    }
+    if (count == 0)
+    {
+        return true;
+    }
+
+    // The responses come in the order of the queries, each line told apart
+    // by its prefix. The IMSI and the firmware version have none.
+    int registration = -1;
+    auto parse = [this, &status, &registration](const ATTokenizer &response) {
+        if (response.hasPrefix("+CGSN") && strlen(response.text()) == 15)
+        {
+            memcpy(status.imei, response.text(), 16);
+            memcpy(_imei, response.text(), 16);
+        }
+        else if (response.hasPrefix("+CSQ") && response.index() == 0)
+        {
+            int value = response.value();
+            status.rssi = value >= 0 && value != 99 ? -113 + value * 2 : 99;
+        }
+        else if (response.hasPrefix("+CEREG") && response.index() == 1)
+        {
+            registration = response.value();
+        }
+        else if (response.hasPrefix("") && response.index() == 0)
+        {
+            const char *text = response.text();
+            if (strlen(text) == 15 && strspn(text, "0123456789") == 15)
+            {
+                memcpy(status.imsi, text, 16);
+                memcpy(_imsi, text, 16);
+            }
+            else if (status.firmware[0] == 0)
+            {
+                copyTo(status.firmware, sizeof(status.firmware), text);
+            }
+        }
+    };
+
+    if (!_separateQueries)
+    {
+        writeQueries(queries, count);
+        if (readCommand(parse) == cmd_error)
+        {
+            // Try one at a time, and keep doing that
+            _separateQueries = true;
+        }
+    }
+    if (_separateQueries)
+    {
+        for (uint8_t i = 0; i < count; i++)
+        {
+            writeCommand(queries[i]);
+            readCommand(parse);
+        }
+    }
+
+    if (registration >= 0)
+    {
+        _regStatus = parseRegistrationStatus(registration);
+        status.registration = _regStatus;
+        status.updated = millis();
+    }
+    return status.imei[0] != 0 && status.imsi[0] != 0 && status.firmware[0] != 0 &&
+        status.registration != RS_UNKNOWN;
+}
+
+bool TelenorNBIoTBase::createSocket(const uint16_t listenPort)
+{
+    waitForCommand();
+    return createSocketAsync(listenPort) && waitForResult();
+}
+
+bool TelenorNBIoTBase::createSocketAsync(const uint16_t listenPort, result_callback callback)
+{
+    if (_socket != -1)
+    {
+        return false;
+    }
+    return openSocket(listenPort, nonstd::move(callback), true);
+}
+
+int TelenorNBIoTBase::openSocket(const uint16_t listenPort)
+{
+    waitForCommand();
+    if (!openSocketAsync(listenPort) || !waitForResult())
+    {
+        return -1;
+    }
+    return _resultValue;
+}
+
+bool TelenorNBIoTBase::openSocketAsync(const uint16_t listenPort, result_callback callback)
+{
+    return openSocket(listenPort, nonstd::move(callback), false);
+}
+
+bool TelenorNBIoTBase::openSocket(const uint16_t listenPort, result_callback callback, bool defaultSocket)
+{
+    // The socket numbers used by the sketch are slots in the socket table,
+    // so they stay the same when the socket is opened again on the module
+    int socket = 0;
+    while (socket < _maxSockets && _sockets[socket].open)
+    {
+        socket++;
+    }
+    if (socket == _maxSockets || isBusy())
+    {
+        return false;
+    }
+    startResult(nonstd::move(callback));
+    writeCommand(at_create_socket, listenPort);
+    // The response is the socket number on the module
+    readValue("", 0);
+    _cmdCallback = [this, socket, listenPort, defaultSocket](command_status status, uint8_t lineCount, char **lines) {
+        int id = status == cmd_ok && _responseValue < MAXSOCKETS ? _responseValue : -1;
+        if (id >= 0)
+        {
+            resetSocket(socket);
+            _sockets[socket].open = true;
+            _sockets[socket].id = id;
+            _sockets[socket].listenPort = listenPort;
+            if (defaultSocket)
+            {
+                _socket = socket;
+            }
+        }
+        completeResult(id >= 0, id >= 0 ? socket : -1);
+    };
+    return true;
+}
+
+bool TelenorNBIoTBase::closeSocket()
+{
+    return closeSocket(_socket);
+}
+
+bool TelenorNBIoTBase::closeSocket(int socket)
+{
+    if (socket < 0 || socket >= _maxSockets || !_sockets[socket].open)
+    {
+        return false;
+    }
+    bool closed = true;
+    if (_sockets[socket].id >= 0)
+    {
+        // Sockets lost when the module rebooted are only in the table
+        writeCommand(at_close_socket, _sockets[socket].id);
+        closed = readCommand() == cmd_ok;
+    }
+    if (closed)
+    {
+        resetSocket(socket);
+        if (socket == _socket)
+        {
+            _socket = -1;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool TelenorNBIoTBase::isOpen(int socket)
+{
+    return socket >= 0 && socket < _maxSockets && _sockets[socket].open && _sockets[socket].id >= 0;
+}
+
+int TelenorNBIoTBase::findSocket(int id)
+{
+    for (uint8_t socket = 0; socket < _maxSockets; socket++)
+    {
+        if (_sockets[socket].open && _sockets[socket].id == id)
+        {
+            return socket;
+        }
+    }
+    return -1;
+}
+
+void TelenorNBIoTBase::resetSocket(int socket)
+{
+    _sockets[socket].open = false;
+    _sockets[socket].id = -1;
+    _sockets[socket].pendingDatagrams = 0;
+    _sockets[socket].listenPort = 0;
+    _sockets[socket].receivedFromIP = IPAddress(0, 0, 0, 0);
+    _sockets[socket].receivedFromPort = 0;
+    _sockets[socket].receivedBytesRemaining = 0;
+    _sockets[socket].answered = false;
+    _notifySockets &= ~(1 << socket);
+}
+
+void TelenorNBIoTBase::resetSockets()
+{
+    _socket = -1;
+    for (uint8_t socket = 0; socket < _maxSockets; socket++)
+    {
+        resetSocket(socket);
+    }
+}
+
+void TelenorNBIoTBase::loseSockets()
+{
+    // The module closes all sockets when it reboots, but the sketch keeps
+    // using the same socket numbers
+    for (uint8_t socket = 0; socket < _maxSockets; socket++)
+    {
+        _sockets[socket].id = -1;
+        _sockets[socket].pendingDatagrams = 0;
+        _sockets[socket].receivedBytesRemaining = 0;
+        _notifySockets &= ~(1 << socket);
+    }
+}
+
+bool TelenorNBIoTBase::reopenSockets()
+{
+    int socket = 0;
+    while (socket < _maxSockets && !(_sockets[socket].open && _sockets[socket].id < 0))
+    {
+        socket++;
+    }
+    if (socket == _maxSockets || isBusy())
+    {
+        return false;
+    }
+    writeCommand(at_create_socket, _sockets[socket].listenPort);
+    readValue("", 0);
+    _cmdCallback = [this, socket](command_status status, uint8_t lineCount, char **lines) {
+        _sockets[socket].id = status == cmd_ok && _responseValue < MAXSOCKETS ? _responseValue : -1;
+        if (_sockets[socket].id >= 0)
+        {
+            // Go on with the next socket right away
+            _lastRegCheck = millis() - REG_CHECK_INTERVAL;
+        }
+    };
+    return true;
+}
+
+bool TelenorNBIoTBase::reboot()
+{
+    resetSockets();
+    return retry(3, [this]() {
+        // The module responds with "REBOOTING" right away, and with OK when
+        // it has rebooted.
+        writeCommand(at_reboot);
+        // The module starts at the default speed
+        changeSpeed(DEFAULT_SPEED);
+        return readCommand() == cmd_ok;
+    }) && enableErrorCodes();
+}
+
+bool TelenorNBIoTBase::online()
+{
+    writeCommand(at_radio_on);
+    return readCommand() == cmd_ok;
+}
+
+bool TelenorNBIoTBase::offline()
+{
+    writeCommand(at_radio_off);
+    return readCommand() == cmd_ok;
+}
+
+int TelenorNBIoTBase::rssi()
+{
+    waitForCommand();
+    if (!rssiAsync(result_callback()))
+    {
+        return 99;
+    }
+    waitForResult();
+    return _resultValue;
+}
+
+bool TelenorNBIoTBase::rssiAsync(result_callback callback)
+{
+    if (isBusy())
+    {
+        return false;
+    }
+    startResult(nonstd::move(callback));
+    writeCommand(at_signal_strength);
+    // Line contains "+CSQ: <rssi>,<ber>"
+    readValue("+CSQ", 0);
+    _cmdCallback = [this](command_status status, uint8_t lineCount, char **lines) {
+        int rssi = 99;
+        if (status == cmd_ok && _responseValue >= 0 && _responseValue != 99)
+        {
+            rssi = -113 + _responseValue * 2;
+        }
+        completeResult(rssi != 99, rssi);
+    };
+    return true;
+}
+
+int TelenorNBIoTBase::errorCode()
+{
+    return _errCode;
+}
+
+bool TelenorNBIoTBase::firmwareVersion(char *buffer, size_t size)
+{
+    const char *version = readFirmwareVersion();
+    return version != NULL && copyTo(buffer, size, version);
+}
+
+#ifndef NBIOT_NO_STRING
+String TelenorNBIoTBase::firmwareVersion()
+{
+    const char *version = readFirmwareVersion();
+    if (version == NULL)
+    {
+        return "ERROR";
+    }
+    return String(version);
+}
+#endif
+
+/**
+ * The version is the first line of the response, which may have commas and
+ * be longer than a field, so the whole line is kept. Returns NULL if the
+ * module doesn't respond or the line is cut.
+ */
+const char *TelenorNBIoTBase::readFirmwareVersion()
+{
+    writeCommand(at_firmware);
+    _collectLines = true;
+    if (readCommand() != cmd_ok || _lineCount < 2 || _truncated)
+    {
+        return NULL;
+    }
+    return lines[0];
+}
+
+void TelenorNBIoTBase::writeBuffer(const char *data, uint16_t length)
+{
+    telenor_nbiot::writeHex(*ublox, (const uint8_t *)data, length);
+    countWritten(length * 2);
+}
+
+bool TelenorNBIoTBase::sendTo(int socket, IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count, result_callback callback, power_save_mode psm)
+{
+    if (!isOpen(socket))
+    {
+        return false;
+    }
+
+    uint16_t length = 0;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (segments[i].length > MAX_DATAGRAM_SIZE - length)
+        {
+            return false;
+        }
+        length += segments[i].length;
+    }
+
+    if (isBusy())
+    {
+        return false;
+    }
+    startResult(nonstd::move(callback));
+    int id = _sockets[socket].id;
+    _sockets[socket].answered = false;
+    startSend(id, remoteIP, port, length, psm);
+
+    // The data is written straight from the caller's buffers
+    for (uint8_t i = 0; i < count; i++)
+    {
+        writeBuffer(segments[i].data, segments[i].length);
+    }
+    endSend(id, length);
+    return true;
+}
+
+void TelenorNBIoTBase::startSend(int id, IPAddress remoteIP, const uint16_t port, const uint16_t length, power_save_mode psm)
+{
+    // Count the send for the release flag it is actually sent with
+    _sendRelease = psm;
+    const char *flag = "0x000";
+    if (psm == psm_sleep_after_send) {
+        flag = "0x200";
+    } else if (psm == psm_sleep_after_response) {
+        flag = "0x400";
+    }
+
+    // The header up to the opening quote of the data
+    const char *text = startCommand(at_send_to);
+    text = writeParams(text, id, remoteIP[0], remoteIP[1], remoteIP[2], remoteIP[3], port, flag, length);
+    writeText(text);
+}
+
+void TelenorNBIoTBase::endSend(int id, const uint16_t length)
+{
+    countWritten(ublox->print("\""));
+    if (debug) Serial.print('"');
+    power_save_mode release = _sendRelease;
+    endCommand([this, length, release](command_status status, uint8_t lineCount, char **lines) {
+        bool sent = status == cmd_ok && _responseValue == length;
+        countSent(sent, release);
+        completeResult(sent, length);
+    }, DEFAULT_TIMEOUT);
+    // The response is <socket>,<bytes sent>
+    _responseHandler = [this, id](const ATTokenizer &response) {
+        if (response.hasPrefix("") && response.index() == 1 && response.value(0) == id)
+        {
+            _responseValue = response.value();
+        }
+    };
+}
+
+bool TelenorNBIoTBase::sendBytes(IPAddress remoteIP, const uint16_t port, const char *data, const uint16_t length)
+{
+    return sendBytes(_socket, remoteIP, port, data, length);
+}
+
+bool TelenorNBIoTBase::sendBytes(IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count)
+{
+    return sendBytes(_socket, remoteIP, port, segments, count);
+}
+
+bool TelenorNBIoTBase::sendBytes(int socket, IPAddress remoteIP, const uint16_t port, const char *data, const uint16_t length)
+{
+    data_segment segment = { data, length };
+    return sendBytes(socket, remoteIP, port, &segment, 1);
+}
+
+bool TelenorNBIoTBase::sendBytes(int socket, IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count)
+{
+    waitForCommand();
+    if (_batch != NULL)
+    {
+        return batchBytes(socket, remoteIP, port, segments, count);
+    }
+    return sendOrQueue(socket, remoteIP, port, segments, count);
+}
+
+bool TelenorNBIoTBase::sendBytes(int socket, IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count, power_save_mode release)
+{
+    waitForCommand();
+    return sendTo(socket, remoteIP, port, segments, count, result_callback(), release) && waitForResult();
+}
+
+bool TelenorNBIoTBase::sendOrQueue(int socket, IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count)
+{
+    if (_queue != NULL)
+    {
+        replayQueue();
+        if (_queue->count() > 0)
+        {
+            // Keep the datagrams in order
+            return queueBytes(socket, remoteIP, port, segments, count);
+        }
+    }
+    if (sendBytesAsync(socket, remoteIP, port, segments, count) && waitForResult())
+    {
+        return true;
+    }
+    if (_queue == NULL)
+    {
+        return false;
+    }
+    delayReplay();
+    return queueBytes(socket, remoteIP, port, segments, count);
+}
+
+bool TelenorNBIoTBase::enableQueue(UplinkQueue &queue)
+{
+    if (queue.count() == 0 && queue.available() == 0)
+    {
+        // Not started with begin()
+        return false;
+    }
+    _queue = &queue;
+    _replayWait = false;
+    return true;
+}
+
+void TelenorNBIoTBase::disableQueue()
+{
+    _queue = NULL;
+}
+
+uint16_t TelenorNBIoTBase::queuedDatagrams()
+{
+    return _queue != NULL ? _queue->count() : 0;
+}
+
+bool TelenorNBIoTBase::queueBytes(int socket, IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count)
+{
+    // Only datagrams that could be sent when the module is back online
+    if (socket < 0 || socket >= _maxSockets || !_sockets[socket].open)
+    {
+        return false;
+    }
+    queued_datagram datagram;
+    datagram.listenPort = _sockets[socket].listenPort;
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        datagram.ip[i] = remoteIP[i];
+    }
+    datagram.port = port;
+    datagram.length = 0;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (segments[i].length > MAX_DATAGRAM_SIZE - datagram.length)
+        {
+            return false;
+        }
+        datagram.length += segments[i].length;
+    }
+
+    if (!_queue->beginPush(datagram))
+    {
+        if (debug) Serial.println(F("Queue is full"));
+        return false;
+    }
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (!_queue->write(segments[i].data, segments[i].length))
+        {
+            return false;
+        }
+    }
+    if (debug) Serial.println(F("Datagram queued"));
+    return _queue->endPush();
+}
+
+bool TelenorNBIoTBase::canReplay()
+{
+    // After a failure, wait for the module to register again or until the
+    // delay has passed
+    if (_maintain && _connState != cs_connected)
+    {
+        return false;
+    }
+    return !_replayWait || millis() - _replayFailed >= REPLAY_DELAY;
+}
+
+bool TelenorNBIoTBase::sendQueued(result_callback callback)
+{
+    queued_datagram datagram;
+    if (!_queue->peek(datagram) || isBusy())
+    {
+        return false;
+    }
+    // The datagram waits until the sketch has opened a socket with the same
+    // listen port, f.e. after the board has restarted
+    int socket = 0;
+    while (socket < _maxSockets && !(_sockets[socket].open && _sockets[socket].listenPort == datagram.listenPort))
+    {
+        socket++;
+    }
+    if (!isOpen(socket))
+    {
+        return false;
+    }
+
+    startResult(nonstd::move(callback));
+    int id = _sockets[socket].id;
+    _sockets[socket].answered = false;
+    startSend(id, IPAddress(datagram.ip[0], datagram.ip[1], datagram.ip[2], datagram.ip[3]), datagram.port, datagram.length, releaseFor(socket));
+
+    // The data is read from the queue in chunks
+    char chunk[HEX_CHUNK_SIZE / 2];
+    for (uint16_t offset = 0; offset < datagram.length; offset += sizeof(chunk))
+    {
+        uint16_t length = datagram.length - offset;
+        if (length > sizeof(chunk))
+        {
+            length = sizeof(chunk);
+        }
+        if (!_queue->read(offset, chunk, length))
+        {
+            memset(chunk, 0, length);
+        }
+        writeBuffer(chunk, length);
+    }
+    endSend(id, datagram.length);
+    return true;
+}
+
+void TelenorNBIoTBase::replayed(bool success)
+{
+    if (success)
+    {
+        _queue->pop();
+    }
+    else
+    {
+        delayReplay();
+    }
+}
+
+void TelenorNBIoTBase::delayReplay()
+{
+    // Don't try the rest until the module has registered again
+    _replayWait = true;
+    _replayFailed = millis();
+}
+
+void TelenorNBIoTBase::replayQueue()
+{
+    // Send all of the queued datagrams, one after the other
+    while (_queue->count() > 0 && canReplay())
+    {
+        // Not sent when the socket hasn't been opened again yet
+        if (!sendQueued([this](bool success, int sent) { replayed(success); }) || !waitForResult())
+        {
+            break;
+        }
+    }
+}
+
+void TelenorNBIoTBase::replayExpiredQueue()
+{
+    if (_queue == NULL || _queue->count() == 0 || _cmdStatus == cmd_pending || !canReplay())
+    {
+        return;
+    }
+    sendQueued([this](bool success, int sent) { replayed(success); });
+}
+
+bool TelenorNBIoTBase::enableBatching(char *frameBuffer, const uint16_t size, const unsigned long maxDelay, const uint16_t threshold)
+{
+    if (size < 2 || size > MAX_DATAGRAM_SIZE || threshold > size || !disableBatching())
+    {
+        return false;
+    }
+    _batch = frameBuffer;
+    _batchSize = size;
+    _batchThreshold = threshold > 0 ? threshold : size;
+    _batchDelay = maxDelay;
+    _batchLength = 0;
+    return true;
+}
+
+bool TelenorNBIoTBase::disableBatching()
+{
+    if (!flush())
+    {
+        return false;
+    }
+    _batch = NULL;
+    return true;
+}
+
+bool TelenorNBIoTBase::flush()
+{
+    waitForCommand();
+    if (_batch == NULL || _batchLength == 0)
+    {
+        return true;
+    }
+    data_segment segment = { _batch, _batchLength };
+    if (!sendOrQueue(_batchSocket, _batchIP, _batchPort, &segment, 1))
+    {
+        return false;
+    }
+    _batchLength = 0;
+    return true;
+}
+
+bool TelenorNBIoTBase::batchBytes(int socket, IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count)
+{
+    uint16_t length = 0;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        length += segments[i].length;
+    }
+    if (length > 255 || length + 1 > _batchSize)
+    {
+        // Doesn't fit in a frame
+        return false;
+    }
+
+    // Messages go in the same frame only if they have the same destination
+    // and fit
+    if (_batchLength > 0 && (socket != _batchSocket || remoteIP != _batchIP ||
+        port != _batchPort || _batchLength + 1 + length > _batchSize))
+    {
+        if (!flush())
+        {
+            return false;
+        }
+    }
+
+    if (_batchLength == 0)
+    {
+        _batchSocket = socket;
+        _batchIP = remoteIP;
+        _batchPort = port;
+        _batchStarted = millis();
+    }
+    _batch[_batchLength++] = length;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        memcpy(_batch + _batchLength, segments[i].data, segments[i].length);
+        _batchLength += segments[i].length;
+    }
+
+    if (_batchLength >= _batchThreshold)
+    {
+        // The message is in the frame now, so sending it again would send it
+        // twice. A frame that can't be sent stays in the buffer until poll()
+        // or flush() sends it.
+        flush();
+    }
+    return true;
+}
+
+void TelenorNBIoTBase::flushExpiredBatch()
+{
+    if (_batch == NULL || _batchLength == 0 || _cmdStatus == cmd_pending ||
+        millis() - _batchStarted < _batchDelay)
+    {
+        return;
+    }
+    data_segment segment = { _batch, _batchLength };
+    if (_queue != NULL && _queue->count() > 0)
+    {
+        // Keep the datagrams in order
+        if (queueBytes(_batchSocket, _batchIP, _batchPort, &segment, 1))
+        {
+            _batchLength = 0;
+        }
+        return;
+    }
+    sendBytesAsync(_batchSocket, _batchIP, _batchPort, &segment, 1, [this](bool success, int sent) {
+        data_segment segment = { _batch, _batchLength };
+        if (!success && _queue != NULL)
+        {
+            delayReplay();
+        }
+        if (success || (_queue != NULL && queueBytes(_batchSocket, _batchIP, _batchPort, &segment, 1)))
+        {
+            _batchLength = 0;
+        }
+        else
+        {
+            // Try again when the delay has passed once more
+            _batchStarted = millis();
+        }
+    });
+}
+
+bool TelenorNBIoTBase::sendBytesAsync(IPAddress remoteIP, const uint16_t port, const char *data, const uint16_t length, result_callback callback)
+{
+    data_segment segment = { data, length };
+    return sendBytesAsync(_socket, remoteIP, port, &segment, 1, nonstd::move(callback));
+}
+
+bool TelenorNBIoTBase::sendBytesAsync(IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count, result_callback callback)
+{
+    return sendBytesAsync(_socket, remoteIP, port, segments, count, nonstd::move(callback));
+}
+
+bool TelenorNBIoTBase::sendBytesAsync(int socket, IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count, result_callback callback)
+{
+    return sendTo(socket, remoteIP, port, segments, count, nonstd::move(callback), releaseFor(socket));
+}
+
+bool TelenorNBIoTBase::sendBytesAsync(int socket, IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count, power_save_mode release, result_callback callback)
+{
+    return sendTo(socket, remoteIP, port, segments, count, nonstd::move(callback), release);
+}
+
+TelenorNBIoTBase::power_save_mode TelenorNBIoTBase::releaseFor(int socket, bool replyExpected)
+{
+    if (!_autoRelease)
+    {
+        // A reply that is known to come keeps the radio up for it, unless
+        // it's up anyway
+        return replyExpected && m_psm == psm_sleep_after_send ? psm_sleep_after_response : m_psm;
+    }
+    // Expect a reply if the last packet got one
+    bool answered = socket >= 0 && socket < _maxSockets && _sockets[socket].answered;
+    return replyExpected || answered ? psm_sleep_after_response : psm_sleep_after_send;
+}
+
+bool TelenorNBIoTBase::sendString(IPAddress remoteIP, const uint16_t port, const char *str)
+{
+    return sendBytes(remoteIP, port, str, strlen(str));
+}
+
+#ifndef NBIOT_NO_STRING
+bool TelenorNBIoTBase::sendString(IPAddress remoteIP, const uint16_t port, const String &str)
+{
+    return sendBytes(remoteIP, port, str.c_str(), str.length());
+}
+#endif
+
+size_t TelenorNBIoTBase::receiveBytes(char *outbuf, uint16_t bufferLength)
+{
+    return receiveBytes(_socket, outbuf, bufferLength);
+}
+
+size_t TelenorNBIoTBase::receiveBytes(int socket, char *outbuf, uint16_t bufferLength)
+{
+    // Pick up any notification about received data first
+    waitForCommand();
+    processInput();
+    if (!isOpen(socket))
+    {
+        return 0;
+    }
+    socket_state &state = _sockets[socket];
+    if (state.pendingDatagrams == 0 && state.receivedBytesRemaining == 0)
+    {
+        return 0;
+    }
+
+    writeCommand(at_receive_from, state.id, bufferLength);
+    // The data is decoded into outbuf as it arrives, and left out of the
+    // response line
+    _hexDecoder.begin(outbuf, bufferLength);
+    _decodeHex = true;
+    // Fields should be <socket>,<ip>,<port>,<length>,<data>,<remaining length>
+    size_t readLength = 0;
+    long remaining = -1;
+    command_status status = readCommand([&state, &readLength, &remaining](const ATTokenizer &response) {
+        switch (response.index())
+        {
+        case 1:
+            state.receivedFromIP.fromString(response.text());
+            break;
+        case 2:
+            state.receivedFromPort = response.value();
+            break;
+        case 3:
+            readLength = response.value();
+            break;
+        case 5:
+            remaining = response.value();
+            break;
+        }
+    });
+    if (status == cmd_ok)
+    {
+        if (remaining >= 0)
+        {
+            if (readLength > _hexDecoder.length())
+            {
+                readLength = _hexDecoder.length();
+            }
+            if (!_hexDecoder.isValid())
+            {
+                if (debug) Serial.println(F("Received malformed hex data"));
+                readLength = 0;
+            }
+            state.receivedBytesRemaining = remaining;
+            if (state.receivedBytesRemaining == 0 && state.pendingDatagrams > 0)
+            {
+                state.pendingDatagrams--;
+            }
+            return readLength;
+        }
+
+        // Nothing more to read
+        state.pendingDatagrams = 0;
+        state.receivedBytesRemaining = 0;
+    }
+    return 0;
+}
+
+size_t TelenorNBIoTBase::receivedBytesRemaining()
+{
+    return receivedBytesRemaining(_socket);
+}
+
+size_t TelenorNBIoTBase::receivedBytesRemaining(int socket)
+{
+    return isOpen(socket) ? _sockets[socket].receivedBytesRemaining : 0;
+}
+
+IPAddress TelenorNBIoTBase::receivedFromIP()
+{
+    return receivedFromIP(_socket);
+}
+
+IPAddress TelenorNBIoTBase::receivedFromIP(int socket)
+{
+    return isOpen(socket) ? _sockets[socket].receivedFromIP : IPAddress(0, 0, 0, 0);
+}
+
+uint16_t TelenorNBIoTBase::receivedFromPort()
+{
+    return receivedFromPort(_socket);
+}
+
+uint16_t TelenorNBIoTBase::receivedFromPort(int socket)
+{
+    return isOpen(socket) ? _sockets[socket].receivedFromPort : 0;
+}
+
+uint8_t TelenorNBIoTBase::pendingDatagrams()
+{
+    return pendingDatagrams(_socket);
+}
+
+uint8_t TelenorNBIoTBase::pendingDatagrams(int socket)
+{
+    if (!isOpen(socket))
+    {
+        return 0;
+    }
+    processInput();
+    return _sockets[socket].pendingDatagrams;
+}
+
+void TelenorNBIoTBase::onReceive(receive_callback callback)
+{
+    _receiveCallback = nonstd::move(callback);
+}
+
+bool TelenorNBIoTBase::powerSaveMode(power_save_mode psm)
+{
+    if (psm >= PSM_MODES)
+    {
+        return false;
+    }
+    // Count what has been used so far for the previous mode
+    updateEnergy();
+    m_psm = psm;
+    _release = psm;
+
+    if (m_psm == psm_sleep_after_send || m_psm == psm_sleep_after_response)
+    {
+        // disable eDRX
+        writeCommand(at_edrx_off);
+
+        // enable Power Save Mode and set active time to as low as possible
+        // mode (0 - disable PSM, 1 - enable PSM, 2 - disable PSM and reset all params)
+        // Requested Periodic RAU (N/A)
+        // Requested GPRS READY timer (N/A)
+        // Requested Periodic TAU (T3412) - 
+        // Requested Active Time (T3324) - 
+        writeCommand(at_psm_on);
+        return readCommand() == cmd_ok;
+    }
+    else
+    {
+        // set eDRX to default value
+        writeCommand(at_edrx_default);
+        if (readCommand() != cmd_ok)
+        {
+            return false;
+        }
+
+        // disable Power Save Mode and reset all PSM parameters to factory values
+        writeCommand(at_psm_reset);
+        return readCommand() == cmd_ok;
+    }
+}
+
+void TelenorNBIoTBase::enableAutoRelease()
+{
+    _autoRelease = true;
+}
+
+void TelenorNBIoTBase::disableAutoRelease()
+{
+    _autoRelease = false;
+}
+
+bool TelenorNBIoTBase::sendCommand(const char *cmd, command_callback callback, uint16_t timeout)
+{
+    if (isBusy())
+    {
+        return false;
+    }
+    writeCommand(cmd, timeout);
+    _cmdCallback = nonstd::move(callback);
+    // The callback gets the response lines
+    _collectLines = true;
+    return true;
+}
+
+bool TelenorNBIoTBase::responseTruncated()
+{
+    return _truncated;
+}
+
+bool TelenorNBIoTBase::isBusy()
+{
+    return processInput() == cmd_pending;
+}
+
+TelenorNBIoTBase::command_status TelenorNBIoTBase::poll()
+{
+    processInput();
+
+    flushExpiredBatch();
+
+    replayExpiredQueue();
+
+    updateConnection();
+
+    // Notifications are only dispatched from here, so the callback can't
+    // interfere with a blocking call waiting for its response.
+    if (_notifySockets && _cmdStatus != cmd_pending)
+    {
+        for (uint8_t socket = 0; socket < _maxSockets; socket++)
+        {
+            if (_notifySockets & (1 << socket))
+            {
+                _notifySockets &= ~(1 << socket);
+                if (_receiveCallback)
+                {
+                    _receiveCallback(socket, _sockets[socket].pendingDatagrams);
+                }
+            }
+        }
+    }
+    return _cmdStatus;
+}
+
+TelenorNBIoTBase::command_status TelenorNBIoTBase::processInput()
+{
+    uint16_t bytesRead = 0;
+    while (ublox->available())
+    {
+        char c = ublox->read();
+        bytesRead++;
+        if (_decodeHex && c != '"' && _tokenizer.inQuotes() && _tokenizer.count() == 4)
+        {
+            // The line is <socket>,"<ip>",<port>,<length>,"<data>",<remaining length>
+            // The data is decoded as it arrives, and left out of the line.
+            // The digits that have already arrived are decoded together, a
+            // byte per step.
+            char digits[HEX_CHUNK_SIZE];
+            uint8_t count = 0;
+            digits[count++] = c;
+            while (count < HEX_CHUNK_SIZE && ublox->available() && ublox->peek() != '"')
+            {
+                digits[count++] = ublox->read();
+            }
+            bytesRead += count - 1;
+            _hexDecoder.write(digits, count);
+            continue;
+        }
+        if ((_collectLines || debug) && c != '\r' && c != '\n')
+        {
+            // Whole lines are only kept for sendCommand() and debug output
+            if (_rxOffset < _bufferSize - 1)
+            {
+                buffer[_rxOffset++] = c;
+            }
+            else
+            {
+                _truncated |= _collectLines;
+            }
+        }
+        uint8_t event = _tokenizer.write(c);
+        if (event)
+        {
+            handleToken(event);
+        }
+    }
+
+    if (_stats != NULL)
+    {
+        _stats->bytesRead += bytesRead;
+    }
+
+    if (_cmdStatus == cmd_pending && millis() - _cmdStarted > _cmdTimeout)
+    {
+        if (debug) Serial.println(F("Command timed out"));
+        completeCommand(cmd_timeout);
+    }
+    return _cmdStatus;
+}
+
+void TelenorNBIoTBase::handleToken(uint8_t event)
+{
+    bool lineDone = event & TOKEN_LINE;
+    char *line = buffer + _lineStart;
+    buffer[_rxOffset] = 0;
+
+    if (handleUnsolicited(lineDone, line))
+    {
+        if (lineDone) keepLine(false, false);
+        return;
+    }
+
+    if (_cmdStatus != cmd_pending)
+    {
+        if (lineDone)
+        {
+            if (debug) {
+                Serial.print(F("Unsolicited line: "));
+                Serial.println(line);
+            }
+            keepLine(false, false);
+        }
+        return;
+    }
+
+    // Completed if line is "OK" - this is the end of the response
+    bool ok = lineDone && _tokenizer.isOK();
+    // ...or if line is "ERROR"
+    bool error = lineDone && _tokenizer.isError();
+    if (!ok && !error && _responseHandler)
+    {
+        _responseHandler(_tokenizer);
+    }
+    if (!lineDone)
+    {
+        return;
+    }
+
+    _decodeHex = false;
+    if (debug) {
+        Serial.print(F("Response line: "));
+        Serial.println(line);
+    }
+    keepLine(_collectLines, ok || error);
+
+    if (ok)
+    {
+        completeCommand(cmd_ok);
+    }
+    if (error)
+    {
+        _errCode = _tokenizer.errorCode();
+        completeCommand(cmd_error);
+    }
+}
+
+void TelenorNBIoTBase::keepLine(bool keep, bool final)
+{
+    char *line = buffer + _lineStart;
+    // The next line needs room for at least its terminating zero
+    if (keep && _lineCount < _maxLines && _rxOffset + 1 < _bufferSize)
+    {
+        lines[_lineCount++] = line;
+        _rxOffset++;
+        _lineStart = _rxOffset;
+    }
+    else if (keep && final)
+    {
+        // Make sure the final result is always the last line. When the
+        // buffer is full it is cut short, but still gets a free slot.
+        if (_lineCount < _maxLines)
+        {
+            lines[_lineCount++] = line;
+        }
+        else
+        {
+            // Take the place of the last line. It comes before this one in
+            // the buffer, so there is room for it.
+            memmove(lines[_maxLines - 1], line, _rxOffset - _lineStart + 1);
+            _truncated = true;
+        }
+        _rxOffset = _lineStart;
+    }
+    else
+    {
+        // Drop lines that aren't kept or don't fit
+        _truncated |= keep;
+        _rxOffset = _lineStart;
+    }
+}
+
+bool TelenorNBIoTBase::handleUnsolicited(bool lineDone, const char *line)
+{
+    // "+CEREG: <status>". The response to CEREG? has more fields.
+    if (_tokenizer.hasPrefix(URC_REGISTRATION) && lineDone && _tokenizer.count() == 1)
+    {
+        if (debug) {
+            Serial.print(F("Registration status: "));
+            Serial.println(line);
+        }
+        _regStatus = parseRegistrationStatus(_tokenizer.value(0));
+        return true;
+    }
+
+    // "+CSCON: <mode>". The response to CSCON? has more fields.
+    if (_tokenizer.hasPrefix(URC_CONNECTION) && lineDone && _tokenizer.count() == 1)
+    {
+        connectRadio(_tokenizer.value(0) == 1);
+        return true;
+    }
+
+    if (!_tokenizer.hasPrefix(URC_RECEIVED))
+    {
+        return false;
+    }
+    if (!lineDone)
+    {
+        return true;
+    }
+
+    if (debug) {
+        Serial.print(F("Received data: "));
+        Serial.println(line);
+    }
+
+    // "+NSONMI: <socket>,<length>"
+    int socket = findSocket(_tokenizer.value(0));
+    if (socket >= 0)
+    {
+        if (_sockets[socket].pendingDatagrams < 255)
+        {
+            _sockets[socket].pendingDatagrams++;
+        }
+        _sockets[socket].answered = true;
+        _notifySockets |= (1 << socket);
+        countReceived();
+    }
+    return true;
+}
+
+void TelenorNBIoTBase::completeCommand(command_status status)
+{
+    _cmdStatus = status;
+    countCommand(status);
+    _responseHandler = response_handler();
+    // The callback might start a new command, so take it out first
+    command_callback callback = move(_cmdCallback);
+    if (callback)
+    {
+        callback(status, _lineCount, lines);
+    }
+}
+
+void TelenorNBIoTBase::waitForCommand()
+{
+    while (_cmdStatus == cmd_pending && processInput() == cmd_pending)
+    {
+        yield();
+    }
+}
+
+TelenorNBIoTBase::command_status TelenorNBIoTBase::readCommand()
+{
+    waitForCommand();
+    return _cmdStatus;
+}
+
+TelenorNBIoTBase::command_status TelenorNBIoTBase::readCommand(response_handler handler)
+{
+    _responseHandler = nonstd::move(handler);
+    return readCommand();
+}
+
+void TelenorNBIoTBase::readValue(const char *prefix, uint8_t index)
+{
+    // Keep the numeric value of a field in the response
+    _responseHandler = [this, prefix, index](const ATTokenizer &response) {
+        if (response.hasPrefix(prefix) && response.index() == index)
+        {
+            _responseValue = response.value();
+        }
+    };
+}
+
+void TelenorNBIoTBase::startCommand()
+{
+    // Process any input from the module before writing the command
+    waitForCommand();
+    processInput();
+    _errCode = -1;
+    _lineCount = 0;
+    _truncated = false;
+    _rxOffset = 0;
+    _lineStart = 0;
+    _collectLines = false;
+    _responseHandler = response_handler();
+    _responseValue = -1;
+    _decodeHex = false;
+    _cmdType = ct_other;
+    if (debug) {
+        Serial.print(F("Write command: "));
+        Serial.print(PREFIX);
+    }
+    countWritten(ublox->print(PREFIX));
+}
+
+const char *TelenorNBIoTBase::startCommand(at_command command)
+{
+    startCommand();
+    _cmdType = pgm_read_byte(&commandTable[command].type);
+    return commandText(command);
+}
+
+const char *TelenorNBIoTBase::commandText(at_command command)
+{
+    return (const char *)pgm_read_ptr(&commandTable[command].text);
+}
+
+void TelenorNBIoTBase::writeQueries(const at_command *queries, uint8_t count)
+{
+    // All the queries on one line, answered with a single OK. The first
+    // error ends the line.
+    startCommand();
+    _cmdType = ct_queries;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (i > 0)
+        {
+            writeParam(";+");
+        }
+        writeText(commandText(queries[i]));
+    }
+    endCommand(command_callback(), DEFAULT_TIMEOUT);
+}
+
+uint16_t TelenorNBIoTBase::commandTimeout(at_command command)
+{
+    return pgm_read_word(&commandTable[command].timeout);
+}
+
+const char *TelenorNBIoTBase::writeText(const char *text)
+{
+    // Write the command text from flash up to the next parameter
+    char c;
+    while ((c = pgm_read_byte(text)) != 0)
+    {
+        text++;
+        if (c == '%')
+        {
+            break;
+        }
+        countWritten(ublox->write(c));
+        if (debug) Serial.write(c);
+    }
+    return text;
+}
+
+void TelenorNBIoTBase::endCommand(command_callback callback, uint16_t timeout)
+{
+    if (debug) Serial.println();
+    countWritten(ublox->print(POSTFIX));
+    if (_stats != NULL)
+    {
+        _stats->commands[_cmdType].issued++;
+        if (_retrying)
+        {
+            _stats->commands[_cmdType].retries++;
+        }
+    }
+    _cmdCallback = nonstd::move(callback);
+    _cmdTimeout = timeout;
+    _cmdStarted = millis();
+    _cmdStatus = cmd_pending;
+}
+
+void TelenorNBIoTBase::writeCommand(const char *cmd, uint16_t timeout)
+{
+    startCommand();
+    _cmdType = commandType(cmd);
+    writeParam(cmd);
+    endCommand(command_callback(), timeout);
+}
+
+uint8_t TelenorNBIoTBase::commandType(const char *cmd)
+{
+    // The name is everything before the parameters or the question mark
+    size_t length = strcspn(cmd, "=?");
+    const char *name = commandNames;
+    // ct_queries has no name, it is only set by writeQueries()
+    for (uint8_t type = 0; type < ct_queries; type++)
+    {
+        size_t nameLength = strlen_P(name);
+        if (nameLength == length && strncmp_P(cmd, name, length) == 0)
+        {
+            return type;
+        }
+        name += nameLength + 1;
+    }
+    return ct_other;
+}
+
+void TelenorNBIoTBase::countCommand(command_status status)
+{
+    if (_stats == NULL)
+    {
+        return;
+    }
+    command_stats &stats = _stats->commands[_cmdType];
+    if (status == cmd_timeout)
+    {
+        stats.timeouts++;
+    }
+    else if (status == cmd_error)
+    {
+        stats.errors++;
+        stats.lastErrorCode = _errCode;
+    }
+
+    unsigned long latency = millis() - _cmdStarted;
+    uint8_t bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (status == cmd_timeout || latency >= (32UL << bucket)))
+    {
+        bucket++;
+    }
+    stats.latency[bucket]++;
+}
+
+void TelenorNBIoTBase::countWritten(size_t bytes)
+{
+    if (_stats != NULL)
+    {
+        _stats->bytesWritten += bytes;
+    }
+}
+
+/**
+ * Charge in microampere-hours for a current in milliamperes over a time in
+ * milliseconds.
+ */
+static uint32_t chargeFor(uint16_t current, uint32_t time)
+{
+    return (uint32_t)current * (time / 3600) + (uint32_t)current * (time % 3600) / 3600;
+}
+
+void TelenorNBIoTBase::accountEnergy(energy_stats *stats, const power_profile &profile)
+{
+    _energy = stats;
+    _profile = profile;
+    _radioConnected = false;
+    if (stats == NULL)
+    {
+        return;
+    }
+    memset(stats, 0, sizeof(energy_stats));
+
+    // Have the module report when it connects and disconnects
+    writeCommand(at_connection_reports);
+    stats->connectionReported = readCommand() == cmd_ok;
+    stats->timeReported = readRadioTime(_txTime, _rxTime);
+}
+
+bool TelenorNBIoTBase::updateEnergy()
+{
+    if (_energy == NULL)
+    {
+        return false;
+    }
+
+    unsigned long now = millis();
+    if (_radioConnected && !_energy->connectionReported && (long)(now - _connectedUntil) >= 0)
+    {
+        endConnection(_connectedUntil);
+        _radioConnected = false;
+    }
+    else if (_radioConnected)
+    {
+        endConnection(now);
+    }
+
+    uint32_t txTime, rxTime;
+    if (!_energy->timeReported || !readRadioTime(txTime, rxTime))
+    {
+        return !_energy->timeReported;
+    }
+    // The times start from zero again when the module reboots
+    uint32_t tx = txTime >= _txTime ? txTime - _txTime : txTime;
+    uint32_t rx = rxTime >= _rxTime ? rxTime - _rxTime : rxTime;
+    mode_energy &mode = energyFor(m_psm);
+    mode.txTime += tx;
+    mode.rxTime += rx;
+    mode.charge += chargeFor(_profile.txCurrent, tx) + chargeFor(_profile.rxCurrent, rx);
+    _txTime = txTime;
+    _rxTime = rxTime;
+    return true;
+}
+
+bool TelenorNBIoTBase::readRadioTime(uint32_t &txTime, uint32_t &rxTime)
+{
+    writeCommand(at_radio_stats);
+    // One line for each value, f.e. "TX time:1239" in milliseconds since
+    // the module booted
+    uint8_t found = 0;
+    command_status status = readCommand([&txTime, &rxTime, &found](const ATTokenizer &response) {
+        if (response.hasPrefix("TX time"))
+        {
+            txTime = strtoul(response.text(), NULL, 10);
+            found++;
+        }
+        else if (response.hasPrefix("RX time"))
+        {
+            rxTime = strtoul(response.text(), NULL, 10);
+            found++;
+        }
+    });
+    return status == cmd_ok && found == 2;
+}
+
+void TelenorNBIoTBase::countSent(bool success, power_save_mode release)
+{
+    if (_energy == NULL || !success)
+    {
+        return;
+    }
+    energyFor(release).sends++;
+    holdConnection(release);
+}
+
+void TelenorNBIoTBase::countReceived()
+{
+    if (_energy == NULL)
+    {
+        return;
+    }
+    // A datagram that arrives is an answer to the last one sent
+    energyFor(_release).receives++;
+    holdConnection(_release);
+}
+
+void TelenorNBIoTBase::connectRadio(bool connected)
+{
+    if (_energy == NULL)
+    {
+        return;
+    }
+    if (connected && !_radioConnected)
+    {
+        _connectedSince = millis();
+    }
+    else if (!connected && _radioConnected)
+    {
+        endConnection(millis());
+    }
+    _radioConnected = connected;
+}
+
+void TelenorNBIoTBase::holdConnection(power_save_mode release)
+{
+    // Only estimate the connection when the module doesn't report it
+    if (_energy->connectionReported)
+    {
+        _release = release;
+        return;
+    }
+    unsigned long now = millis();
+    if (_radioConnected && (long)(now - _connectedUntil) >= 0)
+    {
+        endConnection(_connectedUntil);
+        _radioConnected = false;
+    }
+    // The connection is counted for the release flag of the last datagram
+    _release = release;
+    unsigned long duration = release == psm_always_on ? _profile.inactivityTime : _profile.releaseTime;
+    if (!_radioConnected)
+    {
+        _radioConnected = true;
+        _connectedSince = now;
+        _connectedUntil = now;
+    }
+    if ((long)(now + duration - _connectedUntil) > 0)
+    {
+        _connectedUntil = now + duration;
+    }
+}
+
+void TelenorNBIoTBase::endConnection(unsigned long until)
+{
+    uint32_t duration = until - _connectedSince;
+    mode_energy &mode = energyFor(_release);
+    mode.connectedTime += duration;
+    mode.charge += chargeFor(_profile.connectedCurrent, duration);
+    _connectedSince = until;
+}
+
+TelenorNBIoTBase::mode_energy &TelenorNBIoTBase::energyFor(power_save_mode psm)
+{
+    // Count anything out of range as the default mode
+    return _energy->modes[psm < PSM_MODES ? psm : psm_sleep_after_send];
+}
+
+void TelenorNBIoTBase::collectStats(statistics *stats)
+{
+    _stats = stats;
+    resetStats();
+}
+
+void TelenorNBIoTBase::resetStats()
+{
+    if (_stats == NULL)
+    {
+        return;
+    }
+    memset(_stats, 0, sizeof(statistics));
+    for (uint8_t type = 0; type < COMMAND_TYPES; type++)
+    {
+        _stats->commands[type].lastErrorCode = -1;
+    }
+}
+
+void TelenorNBIoTBase::startResult(result_callback callback)
+{
+    _resultCallback = nonstd::move(callback);
+    _resultSuccess = false;
+    _resultValue = 0;
+}
+
+void TelenorNBIoTBase::completeResult(bool success, int value)
+{
+    _resultSuccess = success;
+    _resultValue = value;
+    result_callback callback = nonstd::move(_resultCallback);
+    _resultCallback = result_callback();
+    if (callback)
+    {
+        callback(success, value);
+    }
+}
+
+bool TelenorNBIoTBase::waitForResult()
+{
+    waitForCommand();
+    return _resultSuccess;
+}
+
+/**
+ * Calls fn until it returns true, up to the given number of attempts, with a
+ * short fixed delay between attempts. The connection state machine has its
+ * own backoff for longer outages.
+ */
+bool TelenorNBIoTBase::retry(uint8_t attempts, nonstd::function<bool ()> fn, uint16_t delayBetween)
+{
+    bool success = false;
+    while (attempts-- && !(success = fn()))
+    {
+        if (attempts > 0)
+        {
+            delay(delayBetween);
+            // Count the commands issued from here on as retries
+            _retrying = true;
+        }
+    }
+    _retrying = false;
+    return success;
 }
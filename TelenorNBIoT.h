@@ -17,20 +17,57 @@
 #define TELENOR_NBIOT_H
 
 #include <Udp.h>
+#include "func.h"
+#include "hex.h"
+#include "tokenizer.h"
+#include "queue.h"
 
 // IP address for the Horde backend
 // #define IP "172.16.7.197"
+// Leave out the functions that take or return String, so the library never
+// allocates from the heap. Must be defined for the library as well as the
+// sketch, f.e. with -DNBIOT_NO_STRING in the build flags.
+// #define NBIOT_NO_STRING
 // Default speed for the serial port
 #define DEFAULT_SPEED 9600
-// Maximum input buffer size.
+// Seconds the module waits for a command at a new serial speed before it
+// goes back to the previous speed.
+#define SPEED_TIMEOUT 3
+// Input buffer size for TelenorNBIoT. Only used for the lines passed to the
+// callback of sendCommand() and for debug output; the library parses the
+// responses as they arrive.
 #define BUFSIZE 255
-// Maximum number of lines.
+// Maximum number of lines passed to the callback of sendCommand() for
+// TelenorNBIoT.
 #define MAXLINES 5
+// Largest datagram the module can send.
+#define MAX_DATAGRAM_SIZE 512
+// Number of sockets supported by the module.
+#define MAXSOCKETS 7
+// Default time to wait for a response to a command, in milliseconds.
+#define DEFAULT_TIMEOUT 2000
+// How often the registration status is checked while attaching, in milliseconds.
+#define REG_CHECK_INTERVAL 5000
+// How long to wait before sending queued datagrams again after a send has
+// failed, in milliseconds. When the connection is maintained they are sent
+// as soon as the module has registered again instead.
+#define REPLAY_DELAY 30000
+// How long readStatus() uses the signal strength and registration status it
+// has read before it reads them again, in milliseconds.
+#define STATUS_MAX_AGE 10000
+// Number of power save modes.
+#define PSM_MODES 3
+// Number of command types counted separately in the statistics.
+#define COMMAND_TYPES 14
+// Number of buckets in the latency histogram for each command type.
+#define LATENCY_BUCKETS 8
 
 /**
- * User-friendly interface to the SARA N2 module from ublox
+ * User-friendly interface to the SARA N2 module from ublox. The buffers are
+ * provided by BasicTelenorNBIoT below, so use TelenorNBIoT or one of the
+ * other sizes defined there.
  */
-class TelenorNBIoT
+class TelenorNBIoTBase
 {
   public:
     enum power_save_mode {
@@ -39,18 +76,186 @@ class TelenorNBIoT
         psm_always_on,
     };
 
+    enum connection_state {
+        cs_offline = 0,
+        cs_attaching,
+        cs_connected,
+        cs_backoff,
+        cs_recovering,
+    };
+
+    enum command_status {
+        cmd_idle = 0,
+        cmd_pending,
+        cmd_ok,
+        cmd_error,
+        cmd_timeout,
+    };
+
     /**
-     * Create a new TelenorNBIoT instance. Default apn is the Telenor NB-IoT
-     * Developer Portal, "mda.ee", but can be overridden. Use a blank string
-     * to get the network default APN. If you specify mobile country code
-     * and mobile network code the device will register on the network faster.
+     * The commands counted separately in the statistics. Commands that
+     * aren't listed are counted as ct_other. ct_queries counts the lines
+     * with several queries that the status and the warm start are read with.
+     */
+    enum command_type {
+        ct_cfun = 0,
+        ct_nsostf,
+        ct_nsorf,
+        ct_nsocr,
+        ct_nsocl,
+        ct_csq,
+        ct_cereg,
+        ct_cgatt,
+        ct_cops,
+        ct_cgdcont,
+        ct_nconfig,
+        ct_nrb,
+        ct_queries,
+        ct_other,
+    };
+
+    /**
+     * Statistics for one command type. The latency is the time from the
+     * command has been written until the final OK or ERROR. latency[0]
+     * counts responses within 32 ms, and each following bucket covers
+     * twice the time of the one before, so latency[6] counts responses
+     * within 2048 ms. The last bucket counts the slower responses and
+     * timeouts.
+     */
+    struct command_stats {
+        uint16_t issued;
+        uint16_t retries;
+        uint16_t timeouts;
+        uint16_t errors;
+        int16_t lastErrorCode;
+        uint16_t latency[LATENCY_BUCKETS];
+    };
+
+    /**
+     * Statistics for the module, collected when enabled with
+     * collectStats(). The struct has no pointers, so it can be sent as is.
+     */
+    struct statistics {
+        command_stats commands[COMMAND_TYPES];
+        uint32_t bytesWritten;
+        uint32_t bytesRead;
+    };
+
+    /**
+     * Radio time and charge used while a power save mode was in effect. The
+     * times are in milliseconds and the charge in microampere-hours.
+     */
+    struct mode_energy {
+        uint16_t sends;
+        uint16_t receives;
+        uint32_t connectedTime;
+        uint32_t txTime;
+        uint32_t rxTime;
+        uint32_t charge;
+    };
+
+    /**
+     * Energy accounting, collected when enabled with accountEnergy().
+     * modes is indexed by power_save_mode. connectionReported is true when
+     * the module reports when it connects and disconnects (AT+CSCON), and
+     * timeReported when it reports the transmit and receive time
+     * (AT+NUESTATS). Otherwise the connected time is estimated from the
+     * power profile, and the transmit and receive time isn't known.
+     */
+    struct energy_stats {
+        mode_energy modes[PSM_MODES];
+        bool connectionReported;
+        bool timeReported;
+    };
+
+    /**
+     * Currents used to estimate the charge, in milliamperes. txCurrent and
+     * rxCurrent are drawn on top of connectedCurrent while transmitting and
+     * receiving. releaseTime and inactivityTime are only used when the
+     * module doesn't report when it disconnects: releaseTime is how long it
+     * stays connected when the network is told it can release the
+     * connection, and inactivityTime how long the network keeps it
+     * otherwise, in milliseconds.
+     */
+    struct power_profile {
+        uint16_t txCurrent;
+        uint16_t rxCurrent;
+        uint16_t connectedCurrent;
+        uint16_t releaseTime;
+        uint32_t inactivityTime;
+    };
+
+    /**
+     * Rough figures for the SARA N2 transmitting at full power. Measure your
+     * own board for better estimates.
+     */
+    static const power_profile defaultPowerProfile;
+
+    /**
+     * Called from poll() when a command completes. The lines are the
+     * response lines from the module, including the final OK or ERROR.
+     * They are only valid until the callback returns.
+     */
+    typedef nonstd::function<void (command_status status, uint8_t lineCount, char **lines)> command_callback;
+
+    /**
+     * Called from poll() when an asynchronous operation completes. The value
+     * is the socket number for createSocketAsync(), the number of bytes sent
+     * for sendBytesAsync() and the RSSI for rssiAsync().
      */
-    TelenorNBIoT(String accessPointName = "mda.ee", uint16_t mobileCountryCode = 0, uint16_t mobileNetworkCode = 0);
+    typedef nonstd::function<void (bool success, int value)> result_callback;
+
+    /**
+     * Called from poll() when the module has received data on a socket.
+     * pendingDatagrams is the number of datagrams waiting to be read with
+     * receiveBytes().
+     */
+    typedef nonstd::function<void (int socket, uint8_t pendingDatagrams)> receive_callback;
+
+    /**
+     * Called to change the speed of the serial port connected to the
+     * module, f.e. with Serial1.begin(baudRate).
+     */
+    typedef nonstd::function<void (uint32_t baudRate)> speed_callback;
+
+    /**
+     * A segment of a datagram. Use a list of segments to send f.e. a header
+     * and a body kept in separate buffers as a single datagram.
+     */
+    struct data_segment {
+        const char *data;
+        uint16_t length;
+    };
 
     /**
      * Initialize the module with the specified baud rate. The default is 9600.
+     *
+     * With warmStart the module is only rebooted if it isn't configured for
+     * the library already, f.e. when the board restarts but the module has
+     * kept running. Settings that differ are changed without a reboot where
+     * possible, and the module stays attached to the network. Sockets left
+     * open on the module are closed.
      */
-    bool begin(Stream &serial, bool debug = false);
+    bool begin(Stream &serial, bool debug = false, bool warmStart = false);
+
+    /**
+     * Switch the serial link to a higher speed (AT+NATSPEED) in begin(),
+     * f.e. 115200 or 921600. Call this before begin(), with the serial port
+     * started at 9600. The callback is called to change the speed of the
+     * serial port. The link is checked with a command at the new speed. If
+     * that fails, both sides go back to the previous speed and begin() still
+     * succeeds, so check serialSpeed().
+     *
+     * The speed isn't stored on the module, so it starts at 9600 again
+     * when it is rebooted or powered off. The speed is negotiated again
+     * after the reboots done by the library.
+     */
+    void setSerialSpeed(uint32_t baudRate, speed_callback callback);
+
+    /**
+     * The current speed of the serial link.
+     */
+    uint32_t serialSpeed();
 
     /**
      * Set the module power save mode.
@@ -61,6 +266,21 @@ class TelenorNBIoT
      */
     bool powerSaveMode(power_save_mode psm = psm_sleep_after_send);
 
+    /**
+     * Choose when the module releases the radio connection for each packet
+     * from the traffic on its socket, instead of from the power save mode.
+     * A packet is sent with psm_sleep_after_response if the previous packet
+     * on the socket got a datagram in return, and with psm_sleep_after_send
+     * otherwise, so the radio only stays connected while replies are
+     * expected. The PSM timers aren't changed.
+     */
+    void enableAutoRelease();
+
+    /**
+     * Release the radio connection as set by powerSaveMode() again.
+     */
+    void disableAutoRelease();
+
     /**
      * Returns true when the board is online, ie there's a GPRS connection
      */
@@ -81,62 +301,195 @@ class TelenorNBIoT
 
     /**
      * Get the IMEI for the module. This is also printed on top of the
-     * module itself.
+     * module itself. The IMEI is written to the buffer, which must have room
+     * for 16 characters. Returns false if the module doesn't respond.
+     */
+    bool imei(char *buffer, size_t size);
+
+    /**
+     * Get the IMSI for the SIM chip attached to the module. The IMSI is
+     * written to the buffer, which must have room for 16 characters.
+     * Returns false if the module doesn't respond.
+     */
+    bool imsi(char *buffer, size_t size);
+
+#ifndef NBIOT_NO_STRING
+    /**
+     * Get the IMEI for the module, or an empty string.
      */
     String imei();
 
     /**
-     * Get the IMSI for the SIM chip attached to the module.
+     * Get the IMSI for the SIM chip attached to the module, or an empty
+     * string.
      */
     String imsi();
+#endif
 
     /**
      * Create a new socket. Call this before attempting to send or receive data
      * with the module. Optionally specify what port to listen on.
+     * This is the default socket, used by the functions that don't take a
+     * socket as a parameter.
      */
     bool createSocket(const uint16_t listenPort = 1234);
 
+    /**
+     * Open an additional socket listening on the specified port. Returns the
+     * socket to use with the functions that take a socket as a parameter, or
+     * -1 if the socket couldn't be opened. The module supports up to seven
+     * sockets, including the default socket.
+     */
+    int openSocket(const uint16_t listenPort);
+
     /**
      * Receive bytes. Pass in a char array to store the bytes and the length of
      * the array. Returns the number of bytes received. If there's no data
-     * available it will return 0. Check receivedBytesRemaining() to see if
-     * there are more bytes available in case the buffer was too small to fill
-     * all data received.
+     * available it will return 0. The module notifies the library when data
+     * arrives, so this only talks to the module when there is data to read.
+     * The data is decoded straight into the array as it is read from the
+     * module, so datagrams up to 512 bytes can be received.
+     * Check receivedBytesRemaining() to see if there are more bytes available
+     * in case the buffer was too small to fill all data received.
      * Check where the data originated from by calling receivedFromIP() and
      * receivedFromPort().
      */
     size_t receiveBytes(char *outbuf, uint16_t bufferLength);
+    size_t receiveBytes(int socket, char *outbuf, uint16_t bufferLength);
 
     /**
      * Number of remaining bytes received
      */
     size_t receivedBytesRemaining();
+    size_t receivedBytesRemaining(int socket);
+
+    /**
+     * Number of datagrams the module has received on the socket that haven't
+     * been read yet.
+     */
+    uint8_t pendingDatagrams();
+    uint8_t pendingDatagrams(int socket);
+
+    /**
+     * Set a callback to be invoked from poll() when data arrives. Call
+     * receiveBytes() from the callback or later to read the data.
+     */
+    void onReceive(receive_callback callback);
 
     /**
      * Get the remote IP address of the last received package
      */
     IPAddress receivedFromIP();
+    IPAddress receivedFromIP(int socket);
 
     /**
      * Get the remote port of the last received package
      */
     uint16_t receivedFromPort();
+    uint16_t receivedFromPort(int socket);
 
     /**
-     * Send UDP packet to remote IP address.
+     * Send UDP packet to remote IP address. The data is written directly
+     * from the buffer to the module. Up to 512 bytes can be sent.
      */
     bool sendBytes(IPAddress remoteIP, const uint16_t port, const char *data, const uint16_t length);
+
+    /**
+     * Send a list of segments as one UDP packet to remote IP address. The
+     * total length can be up to 512 bytes.
+     */
+    bool sendBytes(IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count);
+
+    /**
+     * Send UDP packet to remote IP address from the specified socket.
+     */
+    bool sendBytes(int socket, IPAddress remoteIP, const uint16_t port, const char *data, const uint16_t length);
+    bool sendBytes(int socket, IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count);
+
+    /**
+     * Send UDP packet and tell the module when to release the radio
+     * connection for this packet only: psm_sleep_after_send right after it
+     * has been sent, psm_sleep_after_response when a datagram has been
+     * received in return, or psm_always_on not at all. The packet is sent
+     * right away, without batching or queueing.
+     */
+    bool sendBytes(int socket, IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count, power_save_mode release);
     
     /**
      * Send a string as a UDP packet to remote IP address.
      */
-    bool sendString(IPAddress remoteIP, const uint16_t port, String str);
+    bool sendString(IPAddress remoteIP, const uint16_t port, const char *str);
+#ifndef NBIOT_NO_STRING
+    bool sendString(IPAddress remoteIP, const uint16_t port, const String &str);
+#endif
+
+    /**
+     * Batch messages sent with sendBytes() and sendString() into one
+     * datagram instead of sending each of them right away. Each message is
+     * stored in the frame buffer as a length byte followed by the message.
+     * The frame is sent when it reaches the threshold (the full buffer size
+     * if 0), when the oldest message has waited maxDelay milliseconds (this
+     * is checked by poll()), when a message for another destination is sent
+     * or when flush() is called. The frame buffer can be up to 512 bytes.
+     * Messages longer than 255 bytes (or the frame buffer) can't be sent
+     * while batching is enabled.
+     *
+     * sendBytes() returns true once the message is in the frame, even if
+     * sending the frame at the threshold fails. The frame is then kept and
+     * sent again when maxDelay has passed or flush() is called, which
+     * returns false if it still fails. sendBytes() only returns false when
+     * the message didn't get into the frame, so it is safe to send it again.
+     */
+    bool enableBatching(char *frameBuffer, const uint16_t size, const unsigned long maxDelay, const uint16_t threshold = 0);
+
+    /**
+     * Send any batched messages and stop batching.
+     */
+    bool disableBatching();
+
+    /**
+     * Send batched messages right away.
+     */
+    bool flush();
+
+    /**
+     * Keep the datagrams that can't be sent by sendBytes(), sendString() or
+     * a batched frame in the queue, f.e. while the module is out of
+     * coverage, and send them again in order. sendBytes() returns true when
+     * the datagram has been queued. New datagrams are queued behind the ones
+     * waiting, so they arrive in order.
+     *
+     * The queued datagrams are sent one after the other when the module has
+     * registered again (with maintainConnection()), or REPLAY_DELAY after
+     * the last failure otherwise. They are sent from poll() and before the
+     * next datagram sent with sendBytes(). If one of them fails the rest
+     * wait, instead of each of them being tried. Datagrams sent with
+     * sendBytesAsync() are not queued, since the callback is told about the
+     * failure.
+     *
+     * Each datagram is sent from the socket with the listen port it was
+     * queued from. When no such socket is open, f.e. after the board has
+     * restarted with the queue in EEPROM, the datagrams wait until the
+     * sketch opens it again. Call clear() on the queue to drop them.
+     */
+    bool enableQueue(UplinkQueue &queue);
+
+    /**
+     * Stop queueing datagrams. Datagrams still in the queue stay there.
+     */
+    void disableQueue();
+
+    /**
+     * Number of datagrams waiting in the queue.
+     */
+    uint16_t queuedDatagrams();
 
     /**
      * Close the socket. This will release any resources allocated on the
      * module. When the socket is closed you can't send or receive data.
      */
     bool closeSocket();
+    bool closeSocket(int socket);
 
     /**
      * Reboot the module. This normally takes three-four seconds. The module
@@ -160,10 +513,19 @@ class TelenorNBIoT
      */
     int errorCode();
 
+    /**
+     * Write the u-blox SARA firmware version to the buffer. This is the whole
+     * first line of the response, up to the size of the response buffer.
+     * Returns false if the module doesn't respond or the version doesn't fit.
+     */
+    bool firmwareVersion(char *buffer, size_t size);
+
+#ifndef NBIOT_NO_STRING
     /**
      * Returns the u-blox SARA firmware Version
      */
     String firmwareVersion();
+#endif
 
     enum registrationStatus_t {
         RS_UNKNOWN = 0,
@@ -177,7 +539,214 @@ class TelenorNBIoT
     bool isRegistered();
     bool isRegistering();
 
+    /**
+     * Identity and status of the module, filled in by readStatus(). rssi is
+     * in dBm, or 99 if it isn't known. updated is the time the RSSI and the
+     * registration status were read, from millis().
+     */
+    struct module_status {
+        char imei[16] = {};
+        char imsi[16] = {};
+        char firmware[TOKEN_FIELD_SIZE] = {};
+        int rssi = 99;
+        registrationStatus_t registration = RS_UNKNOWN;
+        unsigned long updated = 0;
+    };
+
+    /**
+     * Read the identity and status of the module with a single command
+     * line, instead of one command for each value. The IMEI, IMSI and
+     * firmware version don't change, so they are only read when they are
+     * missing from the struct. Keep the struct around to skip them the next
+     * time. The RSSI and registration status are read again when they are
+     * older than maxAge milliseconds. Nothing is sent to the module if all
+     * the values are there and fresh enough. Returns false if any of them
+     * couldn't be read, except for the RSSI.
+     *
+     * If the module doesn't accept several commands on one line, the
+     * values are read one at a time from then on.
+     */
+    bool readStatus(module_status &status, unsigned long maxAge = STATUS_MAX_AGE);
+
+    /**
+     * Keep the module attached to the network. Call this after begin(), and
+     * call poll() from loop() to drive the connection state machine.
+     *
+     * The module reports changes to the registration status. If it hasn't
+     * registered within attachTimeout milliseconds, or registration is
+     * denied, the library waits before it reboots and reconfigures the
+     * module. The wait starts at minBackoff and doubles after each failed
+     * attempt up to maxBackoff, and a random part of it is added so devices
+     * that lost the network at the same time don't reconnect at the same
+     * time. The random number generator is seeded with the IMEI here, so
+     * devices don't wait the same random times even if the sketch doesn't
+     * call randomSeed(). Sockets are opened again on the same ports when the module has
+     * attached after a reboot, and keep their socket numbers.
+     */
+    bool maintainConnection(unsigned long attachTimeout = 120000, unsigned long minBackoff = 10000, unsigned long maxBackoff = 1800000);
+
+    /**
+     * Stop maintaining the connection.
+     */
+    void stopMaintainingConnection();
+
+    /**
+     * The state of the connection maintained by maintainConnection().
+     * cs_offline when the connection isn't maintained.
+     */
+    connection_state connectionState();
+
+    /**
+     * Collect statistics for each command type and count the bytes on the
+     * serial link. The sketch provides the struct, which is reset. Pass
+     * NULL to stop collecting.
+     */
+    void collectStats(statistics *stats);
+
+    /**
+     * Reset the statistics to zero.
+     */
+    void resetStats();
+
+    /**
+     * Estimate the radio time and charge used for each power save mode.
+     * The sketch provides the struct, which is reset. Everything is counted
+     * for the power save mode in effect when it happens. Pass NULL to stop
+     * accounting.
+     */
+    void accountEnergy(energy_stats *stats, const power_profile &profile = defaultPowerProfile);
+
+    /**
+     * Bring the energy accounting up to date. This reads the transmit and
+     * receive time from the module, so call it before reading the struct.
+     */
+    bool updateEnergy();
+
+    /**
+     * Send an AT command to the module without waiting for the response.
+     * The command is specified without the "AT+" prefix. Call poll() from
+     * loop() to process the response; the callback is invoked from poll()
+     * when the command completes. Returns false if another command is still
+     * pending.
+     *
+     * The blocking functions in this class wait for the previous command to
+     * complete and call yield() while they wait for the module, so a sketch
+     * can do other work by implementing yield().
+     */
+    bool sendCommand(const char *cmd, command_callback callback = command_callback(), uint16_t timeout = DEFAULT_TIMEOUT);
+
+    /**
+     * True if some of the response lines to the last command sent with
+     * sendCommand() were cut short or left out because they didn't fit in
+     * the buffer. The final OK or ERROR is still the last line, but it is
+     * cut short as well if there was no room left for it.
+     */
+    bool responseTruncated();
+
+    /**
+     * Process input from the module. Call this from loop() when using the
+     * asynchronous functions or onReceive(). Returns the status of the
+     * current (or last) command.
+     */
+    command_status poll();
+
+    /**
+     * Returns true while a command is waiting for a response from the module.
+     */
+    bool isBusy();
+
+    /**
+     * Asynchronous version of createSocket(). The callback is invoked from
+     * poll() with the socket number.
+     */
+    bool createSocketAsync(const uint16_t listenPort = 1234, result_callback callback = result_callback());
+
+    /**
+     * Asynchronous version of openSocket(). The callback is invoked from
+     * poll() with the socket number.
+     */
+    bool openSocketAsync(const uint16_t listenPort, result_callback callback = result_callback());
+
+    /**
+     * Asynchronous version of sendBytes(). The data is written to the module
+     * before this returns, and the callback is invoked from poll() with the
+     * number of bytes sent.
+     */
+    bool sendBytesAsync(IPAddress remoteIP, const uint16_t port, const char *data, const uint16_t length, result_callback callback = result_callback());
+    bool sendBytesAsync(IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count, result_callback callback = result_callback());
+    bool sendBytesAsync(int socket, IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count, result_callback callback = result_callback());
+    bool sendBytesAsync(int socket, IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count, power_save_mode release, result_callback callback = result_callback());
+
+    /**
+     * Asynchronous version of rssi(). The callback is invoked from poll()
+     * with the RSSI.
+     */
+    bool rssiAsync(result_callback callback);
+
+  protected:
+    struct socket_state {
+        bool open = false;
+        // Socket number on the module, or -1 if the module has lost it
+        int8_t id = -1;
+        uint8_t pendingDatagrams = 0;
+        // A datagram has arrived since the last packet was sent
+        bool answered = false;
+        uint16_t listenPort = 0;
+        IPAddress receivedFromIP;
+        uint16_t receivedFromPort = 0;
+        size_t receivedBytesRemaining = 0;
+    };
+
+    TelenorNBIoTBase(char *buffer, uint16_t bufferSize, char **lines, uint8_t maxLines,
+        socket_state *sockets, uint8_t maxSockets,
+        const char *accessPointName, uint16_t mobileCountryCode, uint16_t mobileNetworkCode);
+
   private:
+    /**
+     * Called for each field of the response lines while a command is
+     * pending, except for the final OK or ERROR.
+     */
+    typedef nonstd::function<void (const ATTokenizer &response)> response_handler;
+
+    /**
+     * The commands sent by the library. The command text is kept in flash,
+     * see the command table in TelenorNBIoT.cpp.
+     */
+    enum at_command {
+        at_error_codes = 0,
+        at_create_socket,
+        at_send_to,
+        at_close_socket,
+        at_receive_from,
+        at_gprs,
+        at_reg_status,
+        at_reg_reports,
+        at_imsi,
+        at_imei,
+        at_reboot,
+        at_radio_on,
+        at_radio_off,
+        at_read_radio,
+        at_signal_strength,
+        at_connect_data,
+        at_firmware,
+        at_read_apn,
+        at_set_apn,
+        at_read_config,
+        at_set_autoconnect,
+        at_read_operator,
+        at_operator_auto,
+        at_operator_manual,
+        at_connection_reports,
+        at_radio_stats,
+        at_edrx_off,
+        at_edrx_default,
+        at_psm_on,
+        at_psm_reset,
+        at_set_speed,
+        at_socket_status,
+    };
+
     bool debug;
     int16_t _socket;
     char _imei[16];
@@ -186,30 +755,244 @@ class TelenorNBIoT
     uint16_t mnc;
     char apn[30];
     Stream* ublox;
-    char buffer[BUFSIZE];
-    char *lines[MAXLINES];
-    power_save_mode m_psm;
+    char *buffer;
+    uint16_t _bufferSize;
+    char **lines;
+    uint8_t _maxLines;
+    ATTokenizer _tokenizer;
+    power_save_mode m_psm = psm_sleep_after_send;
     int _errCode = -1;
-    IPAddress _receivedFromIP;
-    uint16_t _receivedFromPort = 0;
-    size_t _receivedBytesRemaining = 0;
+    socket_state *_sockets;
+    uint8_t _maxSockets;
+    command_status _cmdStatus = cmd_idle;
+    command_callback _cmdCallback;
+    response_handler _responseHandler;
+    int _responseValue = -1;
+    bool _collectLines = false;
+    bool _truncated = false;
+    unsigned long _cmdStarted = 0;
+    uint16_t _cmdTimeout = DEFAULT_TIMEOUT;
+    uint8_t _lineCount = 0;
+    uint16_t _rxOffset = 0;
+    uint16_t _lineStart = 0;
+    result_callback _resultCallback;
+    bool _resultSuccess = false;
+    int _resultValue = 0;
+    uint8_t _notifySockets = 0;
+    receive_callback _receiveCallback;
+    char *_batch = NULL;
+    uint16_t _batchSize = 0;
+    uint16_t _batchLength = 0;
+    uint16_t _batchThreshold = 0;
+    unsigned long _batchDelay = 0;
+    unsigned long _batchStarted = 0;
+    int _batchSocket = -1;
+    IPAddress _batchIP;
+    uint16_t _batchPort = 0;
+    UplinkQueue *_queue = NULL;
+    bool _replayWait = false;
+    unsigned long _replayFailed = 0;
+    HexDecoder _hexDecoder;
+    bool _decodeHex = false;
+    bool _maintain = false;
+    bool _autoRelease = false;
+    bool _separateQueries = false;
+    uint32_t _speed = DEFAULT_SPEED;
+    uint32_t _serialSpeed = DEFAULT_SPEED;
+    speed_callback _speedCallback;
+    connection_state _connState = cs_offline;
+    registrationStatus_t _regStatus = RS_UNKNOWN;
+    unsigned long _stateSince = 0;
+    unsigned long _lastRegCheck = 0;
+    unsigned long _attachTimeout = 0;
+    unsigned long _minBackoff = 0;
+    unsigned long _maxBackoff = 0;
+    unsigned long _backoffDelay = 0;
+    uint8_t _attempts = 0;
+    uint8_t _recoveryStep = 0;
+    statistics *_stats = NULL;
+    uint8_t _cmdType = ct_other;
+    bool _retrying = false;
+    energy_stats *_energy = NULL;
+    power_profile _profile;
+    bool _radioConnected = false;
+    unsigned long _connectedSince = 0;
+    unsigned long _connectedUntil = 0;
+    power_save_mode _sendRelease = psm_sleep_after_send;
+    power_save_mode _release = psm_sleep_after_send;
+    uint32_t _txTime = 0;
+    uint32_t _rxTime = 0;
 
     bool enableErrorCodes();
+    bool resume();
+    void findSpeed();
+    bool negotiateSpeed();
+    void changeSpeed(uint32_t baudRate);
+    bool isNetworkOperator(int mode, uint32_t networkOperator, uint16_t mobileCountryCode, uint16_t mobileNetworkCode);
     bool setAutoConnect(bool enabled);
     bool dataOn();
-    uint8_t readCommand(char **lines);
-    void writeCommand(const char *cmd);
-    void drain();
+    command_status readCommand();
+    command_status readCommand(response_handler handler);
+    void writeCommand(const char *cmd, uint16_t timeout = DEFAULT_TIMEOUT);
+    void startCommand();
+    const char *startCommand(at_command command);
+    const char *commandText(at_command command);
+    void writeQueries(const at_command *queries, uint8_t count);
+    uint16_t commandTimeout(at_command command);
+    const char *writeText(const char *text);
+
+    /**
+     * Write a command from the command table to the module. The parameters
+     * are written in place of the % signs in the command text, straight to
+     * the module without formatting them in a buffer first.
+     */
+    template<typename... Params>
+    void writeCommand(at_command command, Params... params)
+    {
+        const char *text = startCommand(command);
+        text = writeParams(text, params...);
+        writeText(text);
+        endCommand(command_callback(), commandTimeout(command));
+    }
+
+    const char *writeParams(const char *text)
+    {
+        return text;
+    }
+
+    template<typename T, typename... Params>
+    const char *writeParams(const char *text, T value, Params... params)
+    {
+        text = writeText(text);
+        writeParam(value);
+        return writeParams(text, params...);
+    }
+
+    template<typename T>
+    void writeParam(T value)
+    {
+        countWritten(ublox->print(value));
+        if (debug) Serial.print(value);
+    }
+
+    void endCommand(command_callback callback, uint16_t timeout);
+    void waitForCommand();
+    void completeCommand(command_status status);
+    uint8_t commandType(const char *cmd);
+    void countCommand(command_status status);
+    void countWritten(size_t bytes);
+    void countSent(bool success, power_save_mode release);
+    void countReceived();
+    void connectRadio(bool connected);
+    void holdConnection(power_save_mode release);
+    void endConnection(unsigned long until);
+    mode_energy &energyFor(power_save_mode psm);
+    const char *readFirmwareVersion();
+    bool readRadioTime(uint32_t &txTime, uint32_t &rxTime);
+    bool retry(uint8_t attempts, nonstd::function<bool ()> fn, uint16_t delayBetween = 100);
+    command_status processInput();
+    void handleToken(uint8_t event);
+    bool handleUnsolicited(bool lineDone, const char *line);
+    void keepLine(bool keep, bool final);
+    bool openSocket(const uint16_t listenPort, result_callback callback, bool defaultSocket);
+    bool isOpen(int socket);
+    int findSocket(int id);
+    void resetSocket(int socket);
+    void resetSockets();
+    void loseSockets();
+    bool reopenSockets();
+    void startResult(result_callback callback);
+    void completeResult(bool success, int value);
+    bool waitForResult();
+    void readValue(const char *prefix, uint8_t index);
+    registrationStatus_t parseRegistrationStatus(int status);
+    void updateConnection();
+    void setConnectionState(connection_state state);
+    void startBackoff();
+    void recover();
+    void writeNetworkOperator(uint16_t mobileCountryCode, uint16_t mobileNetworkCode);
     bool setNetworkOperator(uint8_t, uint8_t);
     bool ensureAccessPointName(const char *accessPointName);
-    char* readAccessPointName();
+    bool isAccessPointName(const char *accessPointName);
+    bool readImei();
+    bool readImsi();
     bool setAccessPointName(const char *accessPointName);
-    bool isOK(const char *line);
-    bool isError(const char *line);
-    int parseErrorCode(const char *line);
-    void hexToBytes(const char *hex, const uint16_t byte_count, char *bytes);
     void writeBuffer(const char *data, uint16_t length);
-    bool sendTo(const char *ip, const uint16_t port, const char *data, const uint16_t length);
+    bool batchBytes(int socket, IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count);
+    void flushExpiredBatch();
+    bool sendOrQueue(int socket, IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count);
+    bool queueBytes(int socket, IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count);
+    bool canReplay();
+    bool sendQueued(result_callback callback);
+    void replayed(bool success);
+    void delayReplay();
+    void replayQueue();
+    void replayExpiredQueue();
+    void startSend(int id, IPAddress remoteIP, const uint16_t port, const uint16_t length, power_save_mode psm);
+    void endSend(int id, const uint16_t length);
+    bool sendTo(int socket, IPAddress remoteIP, const uint16_t port, const data_segment *segments, const uint8_t count, result_callback callback, power_save_mode psm);
+    power_save_mode releaseFor(int socket, bool replyExpected = false);
+
+    // Sends each packet right away, without batching or queueing
+    friend class TelenorNBIoTUDPBase;
+    // Keeps the radio up for the acknowledgement
+    friend class ReliableLinkBase;
+};
+
+/**
+ * The library with buffers of the given sizes:
+ *
+ * BufferSize is the number of bytes kept of the response to a command sent
+ * with sendCommand(), and of each line of debug output.
+ * MaxLines is the number of lines passed to the callback of sendCommand().
+ * MaxSockets is the number of sockets that can be open at the same time, up
+ * to the 7 supported by the module.
+ *
+ * The code is shared by all sizes, only the buffers are in this class.
+ */
+template<uint16_t BufferSize, uint8_t MaxLines, uint8_t MaxSockets>
+class BasicTelenorNBIoT : public TelenorNBIoTBase
+{
+    static_assert(BufferSize >= 2, "BufferSize must be at least 2");
+    static_assert(MaxLines >= 1, "MaxLines must be at least 1");
+    static_assert(MaxSockets >= 1 && MaxSockets <= MAXSOCKETS, "The module supports 1 to 7 sockets");
+
+  public:
+    /**
+     * Create a new TelenorNBIoT instance. Default apn is the Telenor NB-IoT
+     * Developer Portal, "mda.ee", but can be overridden. Use a blank string
+     * to get the network default APN. If you specify mobile country code
+     * and mobile network code the device will register on the network faster.
+     * APNs longer than 29 characters are cut.
+     */
+    BasicTelenorNBIoT(const char *accessPointName = "mda.ee", uint16_t mobileCountryCode = 0, uint16_t mobileNetworkCode = 0)
+        : TelenorNBIoTBase(_bufferStorage, BufferSize, _lineStorage, MaxLines, _socketStorage, MaxSockets,
+            accessPointName, mobileCountryCode, mobileNetworkCode)
+    {
+    }
+
+#ifndef NBIOT_NO_STRING
+    BasicTelenorNBIoT(const String &accessPointName, uint16_t mobileCountryCode = 0, uint16_t mobileNetworkCode = 0)
+        : BasicTelenorNBIoT(accessPointName.c_str(), mobileCountryCode, mobileNetworkCode)
+    {
+    }
+#endif
+
+  private:
+    char _bufferStorage[BufferSize];
+    char *_lineStorage[MaxLines];
+    socket_state _socketStorage[MaxSockets];
 };
 
+// The default sizes
+typedef BasicTelenorNBIoT<BUFSIZE, MAXLINES, MAXSOCKETS> TelenorNBIoT;
+
+// For boards with 2 KB of RAM, like the Arduino Uno. One socket, and room for
+// short responses to sendCommand().
+typedef BasicTelenorNBIoT<64, 2, 1> TelenorNBIoTSlim;
+
+// For boards with plenty of RAM, like SAMD and ESP boards. sendCommand() can
+// read a whole 512 byte datagram with AT+NSORF.
+typedef BasicTelenorNBIoT<1100, 8, MAXSOCKETS> TelenorNBIoTLarge;
+
 #endif
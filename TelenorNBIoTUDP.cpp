@@ -0,0 +1,195 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "TelenorNBIoTUDP.h"
+
+TelenorNBIoTUDPBase::TelenorNBIoTUDPBase(TelenorNBIoTBase &nbiot, char *txBuffer, uint16_t txSize, char *rxBuffer, uint16_t rxSize)
+    : _nbiot(nbiot)
+{
+    _txBuffer = txBuffer;
+    _txSize = txSize;
+    _rxBuffer = rxBuffer;
+    _rxSize = rxSize;
+}
+
+uint8_t TelenorNBIoTUDPBase::begin(uint16_t port)
+{
+    stop();
+    _socket = _nbiot.openSocket(port);
+    return _socket >= 0 ? 1 : 0;
+}
+
+void TelenorNBIoTUDPBase::stop()
+{
+    if (_socket >= 0)
+    {
+        _nbiot.closeSocket(_socket);
+        _socket = -1;
+    }
+    _txStarted = false;
+    _rxLength = 0;
+    _rxOffset = 0;
+}
+
+int TelenorNBIoTUDPBase::beginPacket(IPAddress ip, uint16_t port)
+{
+    if (_socket < 0)
+    {
+        return 0;
+    }
+    _txIP = ip;
+    _txPort = port;
+    _txLength = 0;
+    _txOverflow = false;
+    _replyExpected = false;
+    _txStarted = true;
+    return 1;
+}
+
+int TelenorNBIoTUDPBase::beginPacket(const char *host, uint16_t port)
+{
+    IPAddress ip;
+    if (!ip.fromString(host))
+    {
+        return 0;
+    }
+    return beginPacket(ip, port);
+}
+
+int TelenorNBIoTUDPBase::endPacket()
+{
+    if (!_txStarted)
+    {
+        return 0;
+    }
+    _txStarted = false;
+    if (_txOverflow)
+    {
+        // A truncated packet is worse than none
+        return 0;
+    }
+
+    TelenorNBIoTBase::data_segment segment = { _txBuffer, _txLength };
+    _nbiot.waitForCommand();
+    return _nbiot.sendBytesAsync(_socket, _txIP, _txPort, &segment, 1, _nbiot.releaseFor(_socket, _replyExpected)) &&
+        _nbiot.waitForResult() ? 1 : 0;
+}
+
+void TelenorNBIoTUDPBase::setReplyExpected(bool replyExpected)
+{
+    _replyExpected = replyExpected;
+}
+
+size_t TelenorNBIoTUDPBase::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t TelenorNBIoTUDPBase::write(const uint8_t *buffer, size_t size)
+{
+    if (!_txStarted)
+    {
+        return 0;
+    }
+    if (size > (size_t)(_txSize - _txLength))
+    {
+        size = _txSize - _txLength;
+        _txOverflow = true;
+    }
+    memcpy(_txBuffer + _txLength, buffer, size);
+    _txLength += size;
+    return size;
+}
+
+int TelenorNBIoTUDPBase::parsePacket()
+{
+    _rxLength = 0;
+    _rxOffset = 0;
+    if (_socket < 0)
+    {
+        return 0;
+    }
+
+    // Skip the rest of a datagram that didn't fit
+    while (_nbiot.receivedBytesRemaining(_socket) > 0)
+    {
+        if (_nbiot.receiveBytes(_socket, _rxBuffer, _rxSize) == 0)
+        {
+            break;
+        }
+    }
+
+    _rxLength = _nbiot.receiveBytes(_socket, _rxBuffer, _rxSize);
+    if (_rxLength > 0)
+    {
+        _rxIP = _nbiot.receivedFromIP(_socket);
+        _rxPort = _nbiot.receivedFromPort(_socket);
+    }
+    return _rxLength;
+}
+
+int TelenorNBIoTUDPBase::available()
+{
+    return _rxLength - _rxOffset;
+}
+
+int TelenorNBIoTUDPBase::read()
+{
+    if (_rxOffset >= _rxLength)
+    {
+        return -1;
+    }
+    return (uint8_t)_rxBuffer[_rxOffset++];
+}
+
+int TelenorNBIoTUDPBase::read(unsigned char *buffer, size_t len)
+{
+    return read((char *)buffer, len);
+}
+
+int TelenorNBIoTUDPBase::read(char *buffer, size_t len)
+{
+    size_t count = _rxLength - _rxOffset;
+    if (count > len)
+    {
+        count = len;
+    }
+    memcpy(buffer, _rxBuffer + _rxOffset, count);
+    _rxOffset += count;
+    return count;
+}
+
+int TelenorNBIoTUDPBase::peek()
+{
+    if (_rxOffset >= _rxLength)
+    {
+        return -1;
+    }
+    return (uint8_t)_rxBuffer[_rxOffset];
+}
+
+void TelenorNBIoTUDPBase::flush()
+{
+}
+
+IPAddress TelenorNBIoTUDPBase::remoteIP()
+{
+    return _rxIP;
+}
+
+uint16_t TelenorNBIoTUDPBase::remotePort()
+{
+    return _rxPort;
+}
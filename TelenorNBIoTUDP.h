@@ -0,0 +1,158 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef TELENOR_NBIOT_UDP_H
+#define TELENOR_NBIOT_UDP_H
+
+#include <Udp.h>
+#include "TelenorNBIoT.h"
+#include "replyhint.h"
+
+// Default size of the packets that can be sent and received
+#define UDP_BUFSIZE 128
+
+/**
+ * The Arduino UDP interface on top of TelenorNBIoT, for libraries like NTP,
+ * CoAP and MQTT-SN clients. Each instance uses a socket of its own. The
+ * buffers are provided by BasicTelenorNBIoTUDP below, so use
+ * TelenorNBIoTUDP or BasicTelenorNBIoTUDP with the sizes you need.
+ *
+ * A packet is written to the transmit buffer and sent as a single datagram
+ * by endPacket(), hex encoded straight from the buffer. Packets are sent
+ * right away, even if batching or a queue is enabled, as the protocols
+ * using this do their own retransmissions. parsePacket() decodes the next
+ * datagram straight into the receive buffer. The part of a datagram that
+ * doesn't fit in the receive buffer is dropped.
+ */
+class TelenorNBIoTUDPBase : public ReplyHintUDP
+{
+  public:
+    /**
+     * Open a socket listening on the port. Returns 1 on success.
+     */
+    uint8_t begin(uint16_t port);
+
+    /**
+     * Close the socket.
+     */
+    void stop();
+
+    /**
+     * Start a packet to the remote IP address and port. The module can't
+     * look up host names, so the host must be an IP address. Returns 1 on
+     * success.
+     */
+    int beginPacket(IPAddress ip, uint16_t port);
+    int beginPacket(const char *host, uint16_t port);
+
+    /**
+     * Send the packet. Returns 1 on success, and 0 if it failed or didn't
+     * fit in the transmit buffer.
+     */
+    int endPacket();
+
+    /**
+     * Tell that the server answers the packet being written, f.e. with an
+     * acknowledgement. The module then keeps the radio up until the answer
+     * has arrived, also when the power save mode or enableAutoRelease()
+     * would release it right after the send. Call it after beginPacket().
+     */
+    void setReplyExpected(bool replyExpected);
+
+    /**
+     * Add to the packet. Returns the number of bytes that fit in the transmit
+     * buffer.
+     */
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+
+    /**
+     * Read the next datagram from the module into the receive buffer.
+     * Returns its length, or 0 if there is nothing to read. Any unread part
+     * of the previous datagram is dropped.
+     */
+    int parsePacket();
+
+    /**
+     * Number of bytes left to read of the current datagram.
+     */
+    int available();
+
+    int read();
+    int read(unsigned char *buffer, size_t len);
+    int read(char *buffer, size_t len);
+    int peek();
+
+    /**
+     * Packets are sent by endPacket(), so there's nothing to wait for.
+     */
+    void flush();
+
+    /**
+     * Where the current datagram was received from.
+     */
+    IPAddress remoteIP();
+    uint16_t remotePort();
+
+  protected:
+    TelenorNBIoTUDPBase(TelenorNBIoTBase &nbiot, char *txBuffer, uint16_t txSize, char *rxBuffer, uint16_t rxSize);
+
+  private:
+    TelenorNBIoTBase &_nbiot;
+    int _socket = -1;
+
+    char *_txBuffer;
+    uint16_t _txSize;
+    uint16_t _txLength = 0;
+    bool _txStarted = false;
+    bool _txOverflow = false;
+    bool _replyExpected = false;
+    IPAddress _txIP;
+    uint16_t _txPort = 0;
+
+    char *_rxBuffer;
+    uint16_t _rxSize;
+    uint16_t _rxLength = 0;
+    uint16_t _rxOffset = 0;
+    IPAddress _rxIP;
+    uint16_t _rxPort = 0;
+};
+
+/**
+ * UDP with buffers of the given sizes. TxSize is the longest packet that can
+ * be sent and RxSize the longest that can be received, up to the 512 bytes
+ * supported by the module.
+ */
+template<uint16_t TxSize, uint16_t RxSize>
+class BasicTelenorNBIoTUDP : public TelenorNBIoTUDPBase
+{
+    static_assert(TxSize >= 1 && TxSize <= MAX_DATAGRAM_SIZE, "The module sends up to 512 bytes");
+    static_assert(RxSize >= 1 && RxSize <= MAX_DATAGRAM_SIZE, "The module receives up to 512 bytes");
+
+  public:
+    BasicTelenorNBIoTUDP(TelenorNBIoTBase &nbiot)
+        : TelenorNBIoTUDPBase(nbiot, _txStorage, TxSize, _rxStorage, RxSize)
+    {
+    }
+
+  private:
+    char _txStorage[TxSize];
+    char _rxStorage[RxSize];
+};
+
+typedef BasicTelenorNBIoTUDP<UDP_BUFSIZE, UDP_BUFSIZE> TelenorNBIoTUDP;
+
+#endif
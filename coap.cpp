@@ -0,0 +1,471 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "coap.h"
+
+// Message types
+#define COAP_CON 0
+#define COAP_NON 1
+#define COAP_ACK 2
+#define COAP_RST 3
+
+// Options used by the client
+#define COAP_URI_PATH 11
+#define COAP_CONTENT_FORMAT 12
+#define COAP_BLOCK2 23
+#define COAP_BLOCK1 27
+
+#define COAP_PAYLOAD_MARKER 0xFF
+
+// Block option values are <num> <more> <size exponent>
+#define BLOCK_VALUE(num, more, exponent) ((long)(num) << 4 | ((more) ? 8 : 0) | (exponent))
+#define BLOCK_MORE(value) (((value) & 8) != 0)
+#define BLOCK_EXPONENT(value) ((value) & 7)
+// Offset of the first byte of the block in the whole payload
+#define BLOCK_OFFSET(value) ((uint32_t)((value) >> 4) << (BLOCK_EXPONENT(value) + 4))
+
+// Option deltas and lengths above 12 are stored in 1 or 2 extra bytes
+static uint8_t optionNibble(uint16_t value, uint8_t *extended, uint8_t &pos)
+{
+    if (value < 13)
+    {
+        return value;
+    }
+    if (value < 269)
+    {
+        extended[pos++] = value - 13;
+        return 13;
+    }
+    value -= 269;
+    extended[pos++] = value >> 8;
+    extended[pos++] = value;
+    return 14;
+}
+
+CoapClient::CoapClient(UDP &udp)
+    : _udp(udp)
+{
+    setBlockSize(COAP_BLOCK_SIZE);
+}
+
+CoapClient::CoapClient(ReplyHintUDP &udp)
+    : _udp(udp), _hintUdp(&udp)
+{
+    setBlockSize(COAP_BLOCK_SIZE);
+}
+
+void CoapClient::begin(IPAddress server, uint16_t port)
+{
+    _server = server;
+    _port = port;
+    _messageId = random(0x10000);
+}
+
+void CoapClient::setConfirmable(bool confirmable)
+{
+    _confirmable = confirmable;
+}
+
+void CoapClient::setBlockSize(uint16_t blockSize)
+{
+    _blockExponent = 0;
+    while (_blockExponent < 6 && (32 << _blockExponent) <= blockSize)
+    {
+        _blockExponent++;
+    }
+}
+
+void CoapClient::setContentFormat(int contentFormat)
+{
+    _contentFormat = contentFormat;
+}
+
+bool CoapClient::get(const char *path, char *response, uint16_t size)
+{
+    return request(coap_get, path, NULL, 0, response, size);
+}
+
+bool CoapClient::post(const char *path, const char *payload, uint16_t length, char *response, uint16_t size)
+{
+    return request(coap_post, path, payload, length, response, size);
+}
+
+bool CoapClient::put(const char *path, const char *payload, uint16_t length, char *response, uint16_t size)
+{
+    return request(coap_put, path, payload, length, response, size);
+}
+
+uint8_t CoapClient::responseCode()
+{
+    return _code;
+}
+
+uint32_t CoapClient::responseLength()
+{
+    return _responseLength;
+}
+
+uint8_t CoapClient::retransmissions()
+{
+    return _retransmissions;
+}
+
+bool CoapClient::request(coap_method method, const char *path, const char *payload, uint16_t length,
+    char *response, uint16_t size)
+{
+    _code = 0;
+    _responseLength = 0;
+    _retransmissions = 0;
+    // A new token for each request, the same for all of its blocks
+    for (uint8_t i = 0; i < COAP_TOKEN_LENGTH; i++)
+    {
+        _token[i] = random(256);
+    }
+
+    uint8_t exponent = _blockExponent;
+    bool blockwise = length > (16 << exponent);
+    if (!_confirmable && response == NULL && !blockwise)
+    {
+        // Nobody waits for the response
+        _messageId++;
+        return writeRequest(method, path, payload, length, -1, -1, false);
+    }
+
+    // Send the payload, in blocks if it doesn't fit in one
+    uint16_t sent = 0;
+    do
+    {
+        uint16_t chunk = length;
+        long block1 = -1;
+        if (blockwise)
+        {
+            uint16_t blockSize = 16 << exponent;
+            chunk = length - sent < blockSize ? length - sent : blockSize;
+            block1 = BLOCK_VALUE(sent >> (exponent + 4), sent + chunk < length, exponent);
+        }
+        if (!exchange(method, path, payload + sent, chunk, block1, -1, response, size, 0))
+        {
+            return false;
+        }
+        sent += chunk;
+        if (sent < length)
+        {
+            if (_code != COAP_CONTINUE)
+            {
+                // The server ended the transfer
+                return true;
+            }
+            if (_responseBlock1 >= 0 && BLOCK_EXPONENT(_responseBlock1) < exponent)
+            {
+                // The server wants smaller blocks
+                exponent = BLOCK_EXPONENT(_responseBlock1);
+            }
+        }
+    } while (sent < length);
+
+    // Fetch the rest of the response if it is sent in blocks
+    while (_responseBlock2 >= 0 && BLOCK_MORE(_responseBlock2) && (_code >> 5) == 2)
+    {
+        uint8_t responseExponent = BLOCK_EXPONENT(_responseBlock2);
+        if (responseExponent == 7)
+        {
+            // Reserved
+            return false;
+        }
+        uint32_t offset = BLOCK_OFFSET(_responseBlock2) + (16 << responseExponent);
+        if (offset >= size)
+        {
+            // The rest doesn't fit anyway
+            break;
+        }
+        // Later blocks can be asked for in smaller sizes
+        uint8_t nextExponent = responseExponent < _blockExponent ? responseExponent : _blockExponent;
+        if (!exchange(method, path, NULL, 0, -1, BLOCK_VALUE(offset >> (nextExponent + 4), false, nextExponent),
+            response, size, offset))
+        {
+            return false;
+        }
+        if (_responseBlock2 < 0 || BLOCK_OFFSET(_responseBlock2) != offset)
+        {
+            // Not the block asked for
+            return (_code >> 5) != 2;
+        }
+    }
+    return true;
+}
+
+bool CoapClient::exchange(coap_method method, const char *path, const char *payload, uint16_t length,
+    long block1, long block2, char *response, uint16_t size, uint32_t offset)
+{
+    _messageId++;
+    bool acknowledged = !_confirmable;
+    unsigned long timeout = COAP_RESPONSE_TIMEOUT;
+    if (_confirmable)
+    {
+        timeout = COAP_ACK_TIMEOUT + random(COAP_ACK_TIMEOUT / 2 + 1);
+    }
+    uint8_t attempts = 0;
+
+    // A write that fails counts as a lost message. The acknowledgement or
+    // the response is on its way back right after it.
+    writeRequest(method, path, payload, length, block1, block2, true);
+    unsigned long start = millis();
+    while (true)
+    {
+        if (_udp.parsePacket() > 0 && _udp.remoteIP() == _server && _udp.remotePort() == _port)
+        {
+            switch (readMessage(response, size, offset))
+            {
+            case msg_response:
+                return true;
+            case msg_empty_ack:
+                // The response follows in a separate message
+                acknowledged = true;
+                timeout = COAP_RESPONSE_TIMEOUT;
+                start = millis();
+                break;
+            case msg_reset:
+                return false;
+            default:
+                break;
+            }
+        }
+        if (millis() - start >= timeout)
+        {
+            if (acknowledged || attempts >= COAP_MAX_RETRANSMIT)
+            {
+                return false;
+            }
+            attempts++;
+            _retransmissions++;
+            timeout *= 2;
+            writeRequest(method, path, payload, length, block1, block2, true);
+            start = millis();
+        }
+        yield();
+    }
+}
+
+bool CoapClient::writeRequest(coap_method method, const char *path, const char *payload, uint16_t length,
+    long block1, long block2, bool replyExpected)
+{
+    if (!_udp.beginPacket(_server, _port))
+    {
+        return false;
+    }
+    if (_hintUdp != NULL)
+    {
+        _hintUdp->setReplyExpected(replyExpected);
+    }
+    // <version> <type> <token length> <code> <message id> <token>
+    uint8_t header[4] = {
+        (uint8_t)(0x40 | (_confirmable ? COAP_CON : COAP_NON) << 4 | COAP_TOKEN_LENGTH),
+        (uint8_t)method,
+        (uint8_t)(_messageId >> 8),
+        (uint8_t)_messageId
+    };
+    _udp.write(header, sizeof(header));
+    _udp.write(_token, COAP_TOKEN_LENGTH);
+
+    // Options are written in the order of their numbers. The path is one
+    // Uri-Path option for each segment.
+    uint16_t last = 0;
+    while (*path)
+    {
+        const char *end = strchr(path, '/');
+        if (end == NULL)
+        {
+            end = path + strlen(path);
+        }
+        if (end > path)
+        {
+            writeOption(COAP_URI_PATH, last, (const uint8_t *)path, end - path);
+        }
+        path = *end ? end + 1 : end;
+    }
+    if (length > 0 && _contentFormat >= 0)
+    {
+        writeUintOption(COAP_CONTENT_FORMAT, last, _contentFormat);
+    }
+    if (block2 >= 0)
+    {
+        writeUintOption(COAP_BLOCK2, last, block2);
+    }
+    if (block1 >= 0)
+    {
+        writeUintOption(COAP_BLOCK1, last, block1);
+    }
+
+    if (length > 0)
+    {
+        _udp.write(COAP_PAYLOAD_MARKER);
+        _udp.write((const uint8_t *)payload, length);
+    }
+    return _udp.endPacket();
+}
+
+void CoapClient::writeOption(uint16_t number, uint16_t &last, const uint8_t *value, uint16_t length)
+{
+    // <delta> <length> [extended delta] [extended length] <value>
+    uint8_t header[5];
+    uint8_t pos = 1;
+    header[0] = optionNibble(number - last, header, pos) << 4;
+    header[0] |= optionNibble(length, header, pos);
+    _udp.write(header, pos);
+    _udp.write(value, length);
+    last = number;
+}
+
+void CoapClient::writeUintOption(uint16_t number, uint16_t &last, uint32_t value)
+{
+    // As few bytes as needed, none for 0
+    uint8_t bytes[4];
+    uint8_t length = 0;
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        if (length > 0 || (value >> shift) & 0xFF)
+        {
+            bytes[length++] = value >> shift;
+        }
+    }
+    writeOption(number, last, bytes, length);
+}
+
+bool CoapClient::writeEmpty(uint8_t type, uint16_t messageId)
+{
+    if (!_udp.beginPacket(_server, _port))
+    {
+        return false;
+    }
+    uint8_t message[4] = { (uint8_t)(0x40 | type << 4), 0, (uint8_t)(messageId >> 8), (uint8_t)messageId };
+    _udp.write(message, sizeof(message));
+    return _udp.endPacket();
+}
+
+bool CoapClient::readExtended(uint16_t &value)
+{
+    if (value == 13)
+    {
+        int b = _udp.read();
+        value = 13 + b;
+        return b >= 0;
+    }
+    if (value == 14)
+    {
+        int high = _udp.read();
+        int low = _udp.read();
+        value = 269 + (high << 8 | low);
+        return low >= 0;
+    }
+    return value < 15;
+}
+
+CoapClient::message_kind CoapClient::readMessage(char *response, uint16_t size, uint32_t offset)
+{
+    uint8_t header[4];
+    uint8_t token[8];
+    if (_udp.read(header, sizeof(header)) != sizeof(header) || header[0] >> 6 != 1)
+    {
+        return msg_ignored;
+    }
+    uint8_t type = header[0] >> 4 & 3;
+    uint8_t tokenLength = header[0] & 0x0F;
+    uint8_t code = header[1];
+    uint16_t messageId = header[2] << 8 | header[3];
+    if (tokenLength > sizeof(token) || _udp.read(token, tokenLength) != tokenLength)
+    {
+        return msg_ignored;
+    }
+    bool ours = tokenLength == COAP_TOKEN_LENGTH && memcmp(token, _token, COAP_TOKEN_LENGTH) == 0;
+
+    if (type == COAP_ACK || type == COAP_RST)
+    {
+        if (messageId != _messageId)
+        {
+            return msg_ignored;
+        }
+        if (type == COAP_RST)
+        {
+            return msg_reset;
+        }
+        if (code == 0)
+        {
+            return msg_empty_ack;
+        }
+        if (!ours)
+        {
+            return msg_ignored;
+        }
+    }
+    else if (!ours)
+    {
+        if (type == COAP_CON)
+        {
+            // Not for us, or a ping
+            writeEmpty(COAP_RST, messageId);
+        }
+        return msg_ignored;
+    }
+
+    // Options, up to the payload marker or the end of the message
+    _responseBlock1 = -1;
+    _responseBlock2 = -1;
+    uint16_t number = 0;
+    int c;
+    while ((c = _udp.read()) >= 0 && c != COAP_PAYLOAD_MARKER)
+    {
+        uint16_t delta = c >> 4;
+        uint16_t length = c & 0x0F;
+        if (!readExtended(delta) || !readExtended(length))
+        {
+            return msg_ignored;
+        }
+        number += delta;
+        uint32_t value = 0;
+        for (uint16_t i = 0; i < length; i++)
+        {
+            int b = _udp.read();
+            if (b < 0)
+            {
+                return msg_ignored;
+            }
+            value = value << 8 | b;
+        }
+        if (number == COAP_BLOCK1)
+        {
+            _responseBlock1 = value;
+        }
+        else if (number == COAP_BLOCK2)
+        {
+            _responseBlock2 = value;
+        }
+    }
+
+    // The payload goes straight into the response buffer
+    uint16_t length = _udp.available();
+    if (response != NULL && offset < size)
+    {
+        _udp.read(response + offset, length < size - offset ? length : size - offset);
+    }
+    _responseLength = offset + length;
+    _code = code;
+
+    if (type == COAP_CON)
+    {
+        // A separate response
+        writeEmpty(COAP_ACK, messageId);
+    }
+    return msg_response;
+}
@@ -0,0 +1,175 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef TELENOR_NBIOT_COAP_H
+#define TELENOR_NBIOT_COAP_H
+
+#include <Arduino.h>
+#include <Udp.h>
+#include "replyhint.h"
+
+#define COAP_PORT 5683
+// Payload bytes in each message of a block-wise transfer
+#define COAP_BLOCK_SIZE 64
+// Time to wait for the acknowledgement of a confirmable message before it is
+// sent again, in milliseconds. A random part of up to half of it is added,
+// and it doubles for each retransmission.
+#define COAP_ACK_TIMEOUT 2000
+#define COAP_MAX_RETRANSMIT 4
+// Time to wait for the response to a non-confirmable request, or for a
+// separate response after the request has been acknowledged, in
+// milliseconds.
+#define COAP_RESPONSE_TIMEOUT 10000
+#define COAP_TOKEN_LENGTH 4
+
+// Response codes, class * 32 + detail
+#define COAP_CREATED 0x41
+#define COAP_DELETED 0x42
+#define COAP_VALID 0x43
+#define COAP_CHANGED 0x44
+#define COAP_CONTENT 0x45
+#define COAP_CONTINUE 0x5F
+
+/**
+ * A CoAP client (RFC 7252) on top of the Arduino UDP interface, f.e.
+ * TelenorNBIoTUDP. Requests are sent to one server, and wait for the
+ * response. Payloads longer than the block size are sent in blocks
+ * (Block1, RFC 7959), and responses sent in blocks (Block2) are put
+ * together in the response buffer.
+ *
+ * Messages are written straight to the UDP packet and responses are read
+ * straight from it, so the client has no buffers of its own and doesn't use
+ * the heap. A confirmable message is written again from the payload when it
+ * is retransmitted.
+ */
+class CoapClient
+{
+  public:
+    enum coap_method {
+        coap_get = 1,
+        coap_post,
+        coap_put,
+        coap_delete,
+    };
+
+    CoapClient(UDP &udp);
+
+    /**
+     * With a UDP implementation that takes a reply hint, like
+     * TelenorNBIoTUDP, it is told which messages are answered, so the
+     * module can keep the radio up while a request waits for its
+     * acknowledgement or response.
+     */
+    CoapClient(ReplyHintUDP &udp);
+
+    /**
+     * Send the requests to the server. The UDP instance must have been
+     * started with begin().
+     */
+    void begin(IPAddress server, uint16_t port = COAP_PORT);
+
+    /**
+     * Send confirmable requests, which are retransmitted until they are
+     * acknowledged (the default), or non-confirmable ones, which are sent
+     * once.
+     */
+    void setConfirmable(bool confirmable);
+
+    /**
+     * Payload bytes in each block of a block-wise transfer. Rounded down to
+     * a power of two from 16 to 1024. The messages must fit in the UDP
+     * packets, with room for the header and options.
+     */
+    void setBlockSize(uint16_t blockSize);
+
+    /**
+     * The Content-Format option sent with payloads, f.e. 0 for text/plain,
+     * 42 for application/octet-stream or 60 for application/cbor. -1 (the
+     * default) leaves it out.
+     */
+    void setContentFormat(int contentFormat);
+
+    /**
+     * Send a request and wait for the response. The path is the resource on
+     * the server, f.e. "sensors/temperature". The payload of the response is
+     * put in the response buffer. Returns true if a response was received,
+     * check responseCode() to see if the request succeeded.
+     *
+     * A non-confirmable request without a response buffer and with a
+     * payload that fits in one block is sent without waiting for a
+     * response.
+     */
+    bool request(coap_method method, const char *path, const char *payload, uint16_t length,
+        char *response = NULL, uint16_t size = 0);
+
+    bool get(const char *path, char *response, uint16_t size);
+    bool post(const char *path, const char *payload, uint16_t length, char *response = NULL, uint16_t size = 0);
+    bool put(const char *path, const char *payload, uint16_t length, char *response = NULL, uint16_t size = 0);
+
+    /**
+     * The code of the last response, f.e. COAP_CONTENT (2.05), or 0 if
+     * there was none. The class is responseCode() >> 5 and the detail
+     * responseCode() & 31.
+     */
+    uint8_t responseCode();
+
+    /**
+     * Length of the payload of the last response. If it is longer than the
+     * response buffer, only the start of it was kept, and the blocks after
+     * the end of the buffer aren't fetched.
+     */
+    uint32_t responseLength();
+
+    /**
+     * Number of times messages were sent again during the last request.
+     */
+    uint8_t retransmissions();
+
+  private:
+    enum message_kind {
+        msg_ignored,
+        msg_response,
+        msg_empty_ack,
+        msg_reset,
+    };
+
+    UDP &_udp;
+    ReplyHintUDP *_hintUdp = NULL;
+    IPAddress _server;
+    uint16_t _port = COAP_PORT;
+    bool _confirmable = true;
+    uint8_t _blockExponent;
+    int _contentFormat = -1;
+
+    uint16_t _messageId = 0;
+    uint8_t _token[COAP_TOKEN_LENGTH];
+    uint8_t _code = 0;
+    uint32_t _responseLength = 0;
+    uint8_t _retransmissions = 0;
+    long _responseBlock1 = -1;
+    long _responseBlock2 = -1;
+
+    bool exchange(coap_method method, const char *path, const char *payload, uint16_t length,
+        long block1, long block2, char *response, uint16_t size, uint32_t offset);
+    bool writeRequest(coap_method method, const char *path, const char *payload, uint16_t length,
+        long block1, long block2, bool replyExpected);
+    void writeOption(uint16_t number, uint16_t &last, const uint8_t *value, uint16_t length);
+    void writeUintOption(uint16_t number, uint16_t &last, uint32_t value);
+    bool writeEmpty(uint8_t type, uint16_t messageId);
+    message_kind readMessage(char *response, uint16_t size, uint32_t offset);
+    bool readExtended(uint16_t &value);
+};
+
+#endif
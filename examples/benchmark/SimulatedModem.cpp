@@ -0,0 +1,681 @@
+/**
+ * Simulated u-blox SARA N2 module for the benchmark example.
+ *
+ * This example is in the public domain.
+ */
+#include "SimulatedModem.h"
+
+SimulatedModem::SimulatedModem(uint32_t baudRate, uint16_t latencyMs)
+{
+    setBaudRate(baudRate);
+    _maxBaudRate = 921600;
+    _nextBaudRate = 0;
+    _previousBaudRate = 0;
+    _speedTimeout = 0;
+    _speedChanged = 0;
+    _latency = latencyMs;
+    _rebootTime = 3000;
+    _joinedCommands = true;
+    _txFree = 0;
+    _cmdLength = 0;
+    _cmdOverflow = false;
+    _responseLength = 0;
+    _responsePos = 0;
+    _responseStart = 0;
+    _gapPos = SIM_RESPONSE_SIZE;
+    _gap = 0;
+    _downlinkLength = 0;
+    _apn[0] = 0;
+    _sockets = 0;
+    _networkAvailable = true;
+    // Factory defaults
+    _radioOn = true;
+    _autoConnect = true;
+    strcpy_P(_operator, PSTR("0"));
+    _connectionReports = false;
+    _connected = false;
+    _txTime = 0;
+    _rxTime = 0;
+    _registrationReports = false;
+    _overflows = 0;
+    resetCounters();
+}
+
+void SimulatedModem::setBaudRate(uint32_t baudRate)
+{
+    setModuleSpeed(baudRate);
+    _storedBaudRate = baudRate;
+    _hostBaudRate = baudRate;
+}
+
+void SimulatedModem::begin(uint32_t baudRate)
+{
+    _hostBaudRate = baudRate;
+}
+
+void SimulatedModem::setMaxBaudRate(uint32_t baudRate)
+{
+    _maxBaudRate = baudRate;
+}
+
+void SimulatedModem::setJoinedCommands(bool accepted)
+{
+    _joinedCommands = accepted;
+}
+
+void SimulatedModem::setModuleSpeed(uint32_t baudRate)
+{
+    _baudRate = baudRate;
+    // One start bit, eight data bits and one stop bit
+    _byteTime = 10000000UL / baudRate;
+}
+
+void SimulatedModem::updateSpeed()
+{
+    // AT+NATSPEED takes effect when the OK has been sent
+    if (_nextBaudRate != 0 && _responsePos >= _responseLength)
+    {
+        _previousBaudRate = _baudRate;
+        setModuleSpeed(_nextBaudRate);
+        _nextBaudRate = 0;
+        _speedChanged = micros();
+    }
+    // Go back to the previous speed if no command arrives at the new one
+    if (_previousBaudRate != 0 && micros() - _speedChanged >= _speedTimeout)
+    {
+        setModuleSpeed(_previousBaudRate);
+        _previousBaudRate = 0;
+    }
+}
+
+bool SimulatedModem::linkWorks()
+{
+    return _hostBaudRate == _baudRate && _baudRate <= _maxBaudRate;
+}
+
+void SimulatedModem::setLatency(uint16_t latencyMs)
+{
+    _latency = latencyMs;
+}
+
+void SimulatedModem::setRebootTime(uint16_t rebootMs)
+{
+    _rebootTime = rebootMs;
+}
+
+void SimulatedModem::setNetworkAvailable(bool available)
+{
+    if (available == _networkAvailable)
+    {
+        return;
+    }
+    _networkAvailable = available;
+    if (_registrationReports)
+    {
+        char line[16];
+        sprintf_P(line, PSTR("+CEREG: %d"), registrationStatus());
+        startResponse((unsigned long)_latency * 1000);
+        respond(line);
+    }
+}
+
+int SimulatedModem::registrationStatus()
+{
+    // Registered on the home network, searching or not searching
+    if (!_radioOn)
+    {
+        return 0;
+    }
+    return _networkAvailable ? 1 : 2;
+}
+
+void SimulatedModem::reportConnection(bool connected)
+{
+    if (connected != _connected && _connectionReports)
+    {
+        respond(connected ? F("+CSCON: 1") : F("+CSCON: 0"));
+    }
+    _connected = connected;
+}
+
+bool SimulatedModem::queueDownlink(const char *data, uint16_t length, uint8_t socket)
+{
+    if (length > SIM_DOWNLINK_SIZE)
+    {
+        return false;
+    }
+    memcpy(_downlink, data, length);
+    _downlinkLength = length;
+
+    if (length > 0)
+    {
+        // Notify about the new datagram
+        char line[24];
+        sprintf_P(line, PSTR("+NSONMI: %d,%u"), socket, length);
+        startResponse((unsigned long)_latency * 1000);
+        respond(line);
+    }
+    return true;
+}
+
+uint16_t SimulatedModem::roundTrips()
+{
+    return _roundTrips;
+}
+
+uint32_t SimulatedModem::bytesReceived()
+{
+    return _bytesReceived;
+}
+
+uint32_t SimulatedModem::bytesSent()
+{
+    return _bytesSent;
+}
+
+uint16_t SimulatedModem::overflows()
+{
+    return _overflows;
+}
+
+void SimulatedModem::resetCounters()
+{
+    _roundTrips = 0;
+    _bytesReceived = 0;
+    _bytesSent = 0;
+}
+
+size_t SimulatedModem::write(uint8_t c)
+{
+    // The byte occupies the line for one byte time. There's no transmit
+    // buffer, so writing blocks just like a full HardwareSerial buffer does.
+    unsigned long now = micros();
+    if ((long)(_txFree - now) > 0)
+    {
+        delayMicroseconds(_txFree - now);
+        now = _txFree;
+    }
+    _txFree = now + _byteTime;
+    _bytesReceived++;
+
+    updateSpeed();
+    if (!linkWorks())
+    {
+        // Garbled
+        _cmdLength = 0;
+        _cmdOverflow = false;
+        return 1;
+    }
+    if (c == '\r')
+    {
+        _cmd[_cmdLength] = 0;
+        _cmdLength = 0;
+        // Commands are prefixed with "AT"
+        if (_cmd[0] == 'A' && _cmd[1] == 'T')
+        {
+            // The new speed works
+            _previousBaudRate = 0;
+            startResponse(_txFree - now + (unsigned long)_latency * 1000);
+            _roundTrips++;
+            if (_cmdOverflow && !startsWith(_cmd + 2, PSTR("+NSOSTF=")))
+            {
+                // Only the hex payload of NSOSTF may be cut off
+                _overflows++;
+                respondError();
+            }
+            else
+            {
+                handleLine(_cmd + 2);
+            }
+        }
+        _cmdOverflow = false;
+    }
+    else if (c != '\n' && _cmdLength < SIM_CMD_SIZE - 1)
+    {
+        _cmd[_cmdLength++] = c;
+    }
+    else if (c != '\n')
+    {
+        _cmdOverflow = true;
+    }
+    return 1;
+}
+
+int SimulatedModem::available()
+{
+    updateSpeed();
+    uint16_t count = arrived();
+    if (!linkWorks())
+    {
+        // The host can't make sense of what arrives
+        if (count > _responsePos)
+        {
+            _responsePos = count;
+        }
+        return 0;
+    }
+    return count > _responsePos ? count - _responsePos : 0;
+}
+
+uint16_t SimulatedModem::arrived()
+{
+    if (_responsePos >= _responseLength)
+    {
+        return _responseLength;
+    }
+    unsigned long elapsed = micros() - _responseStart;
+    if ((long)elapsed < 0)
+    {
+        return 0;
+    }
+    unsigned long count = elapsed / _byteTime;
+    if (count > _gapPos)
+    {
+        // Bytes after the gap arrive later
+        count = elapsed > _gap ? (elapsed - _gap) / _byteTime : 0;
+        if (count < _gapPos)
+        {
+            count = _gapPos;
+        }
+    }
+    return count < _responseLength ? count : _responseLength;
+}
+
+int SimulatedModem::read()
+{
+    if (available() == 0)
+    {
+        return -1;
+    }
+    _bytesSent++;
+    return (unsigned char)_response[_responsePos++];
+}
+
+int SimulatedModem::peek()
+{
+    if (available() == 0)
+    {
+        return -1;
+    }
+    return (unsigned char)_response[_responsePos];
+}
+
+void SimulatedModem::flush()
+{
+}
+
+void SimulatedModem::startResponse(unsigned long delayMicros)
+{
+    // Keep anything the host hasn't read yet, it's sent before the response
+    uint16_t unread = _responseLength - _responsePos;
+    memmove(_response, _response + _responsePos, unread);
+    _responseLength = unread;
+    _responsePos = 0;
+    _gapPos = SIM_RESPONSE_SIZE;
+    _responseStart = micros() + delayMicros;
+}
+
+bool SimulatedModem::startsWith(const char *cmd, const char *prefix)
+{
+    // The prefix is in flash
+    return strncmp_P(cmd, prefix, strlen_P(prefix)) == 0;
+}
+
+void SimulatedModem::respond(const char *line)
+{
+    addLine(line, strlen(line), false);
+}
+
+void SimulatedModem::respond(const __FlashStringHelper *line)
+{
+    addLine((const char *)line, strlen_P((const char *)line), true);
+}
+
+void SimulatedModem::addLine(const char *line, uint16_t length, bool inFlash)
+{
+    if (_responseLength + length + 4 >= SIM_RESPONSE_SIZE)
+    {
+        _overflows++;
+        return;
+    }
+    char *p = _response + _responseLength;
+    *p++ = '\r';
+    *p++ = '\n';
+    if (inFlash)
+    {
+        memcpy_P(p, line, length);
+    }
+    else
+    {
+        memcpy(p, line, length);
+    }
+    p += length;
+    *p++ = '\r';
+    *p++ = '\n';
+    _responseLength += length + 4;
+}
+
+void SimulatedModem::respondOK()
+{
+    respond(F("OK"));
+}
+
+void SimulatedModem::respondError()
+{
+    respond(F("ERROR"));
+}
+
+void SimulatedModem::respondDownlink(int socket, uint16_t maxLength)
+{
+    if (_downlinkLength == 0)
+    {
+        respondOK();
+        return;
+    }
+
+    uint16_t length = _downlinkLength < maxLength ? _downlinkLength : maxLength;
+    char line[SIM_RESPONSE_SIZE - 10];
+    int pos = sprintf_P(line, PSTR("%d,\"172.16.15.14\",1234,%u,\""), socket, length);
+    for (uint16_t i = 0; i < length && pos < (int)sizeof(line) - 8; i++)
+    {
+        pos += sprintf_P(line + pos, PSTR("%02X"), (unsigned char)_downlink[i]);
+    }
+    sprintf_P(line + pos, PSTR("\",%u"), _downlinkLength - length);
+    respond(line);
+    respondOK();
+
+    memmove(_downlink, _downlink + length, _downlinkLength - length);
+    _downlinkLength -= length;
+}
+
+void SimulatedModem::handleLine(char *line)
+{
+    // Several commands can be sent on one line, f.e. AT+CSQ;+CEREG?. Only
+    // the OK of the last one is sent, and an error ends the line.
+    char *cmd = line;
+    if (!_joinedCommands && strchr(cmd, ';') != NULL)
+    {
+        respondError();
+        return;
+    }
+    while (true)
+    {
+        char *next = strchr(cmd, ';');
+        if (next != NULL)
+        {
+            *next = 0;
+        }
+        handleCommand(cmd);
+        if (next == NULL)
+        {
+            return;
+        }
+        if (_responseLength < 6 || memcmp_P(_response + _responseLength - 6, PSTR("\r\nOK\r\n"), 6) != 0)
+        {
+            return;
+        }
+        _responseLength -= 6;
+        cmd = next + 1;
+    }
+}
+
+void SimulatedModem::handleCommand(const char *cmd)
+{
+    char line[64];
+
+    if (cmd[0] == 0)
+    {
+        respondOK();
+    }
+    else if (cmd[0] != '+')
+    {
+        respondError();
+    }
+    else if (startsWith(++cmd, PSTR("NRB")))
+    {
+        // The module responds right away, but the rest of the response is
+        // sent when the module has rebooted
+        _sockets = 0;
+        _registrationReports = false;
+        _connectionReports = false;
+        _connected = false;
+        _txTime = 0;
+        _rxTime = 0;
+        _radioOn = _autoConnect;
+        // AT+NATSPEED doesn't store the speed
+        setModuleSpeed(_storedBaudRate);
+        _nextBaudRate = 0;
+        _previousBaudRate = 0;
+        respond(F("REBOOTING"));
+        _gapPos = _responseLength;
+        _gap = (unsigned long)_rebootTime * 1000;
+        respond(F("u-blox"));
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("CGDCONT?")))
+    {
+        sprintf_P(line, PSTR("+CGDCONT: 0,\"IP\",\"%s\",,0,0,,,,,0"), _apn);
+        respond(line);
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("CGDCONT=0,\"IP\",\"")))
+    {
+        strncpy(_apn, cmd + 16, sizeof(_apn) - 1);
+        _apn[sizeof(_apn) - 1] = 0;
+        char *quote = strchr(_apn, '"');
+        if (quote)
+        {
+            *quote = 0;
+        }
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("NCONFIG?")))
+    {
+        sprintf_P(line, PSTR("+NCONFIG: \"AUTOCONNECT\",\"%s\""), _autoConnect ? "TRUE" : "FALSE");
+        respond(line);
+        respond(F("+NCONFIG: \"CR_0354_0338_SCRAMBLING\",\"TRUE\""));
+        respond(F("+NCONFIG: \"CR_0859_SI_AVOID\",\"TRUE\""));
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("NCONFIG=\"AUTOCONNECT\",")))
+    {
+        _autoConnect = startsWith(cmd + 22, PSTR("\"TRUE\""));
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("CFUN?")))
+    {
+        sprintf_P(line, PSTR("+CFUN: %d"), _radioOn ? 1 : 0);
+        respond(line);
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("CFUN=")))
+    {
+        _radioOn = atoi(cmd + 5) == 1;
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("COPS?")))
+    {
+        sprintf_P(line, PSTR("+COPS: %s"), _operator);
+        respond(line);
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("COPS=")))
+    {
+        strncpy(_operator, cmd + 5, sizeof(_operator) - 1);
+        _operator[sizeof(_operator) - 1] = 0;
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("CGATT?")))
+    {
+        sprintf_P(line, PSTR("+CGATT: %d"), registrationStatus() == 1 ? 1 : 0);
+        respond(line);
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("CEREG?")))
+    {
+        sprintf_P(line, PSTR("+CEREG: %d,%d"), _registrationReports ? 1 : 0, registrationStatus());
+        respond(line);
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("CEREG=")))
+    {
+        _registrationReports = atoi(cmd + 6) == 1;
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("CIMI")))
+    {
+        respond(F("242016000000001"));
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("CGSN=1")))
+    {
+        respond(F("+CGSN: 357517080000001"));
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("CGMR")))
+    {
+        respond(F("V100R100C10B657SP3"));
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("CSQ")))
+    {
+        respond(F("+CSQ: 20,99"));
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("NSOCR=")))
+    {
+        // Sockets are numbered from 0 and the module supports up to 7
+        uint8_t socket = 0;
+        while (socket < 7 && (_sockets & (1 << socket)))
+        {
+            socket++;
+        }
+        if (socket == 7)
+        {
+            respondError();
+            return;
+        }
+        _sockets |= (1 << socket);
+        sprintf_P(line, PSTR("%d"), socket);
+        respond(line);
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("NSOCL=")))
+    {
+        int socket = atoi(cmd + 6);
+        if (socket < 0 || socket >= 7 || !(_sockets & (1 << socket)))
+        {
+            respondError();
+            return;
+        }
+        _sockets &= ~(1 << socket);
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("NSOSTATUS")))
+    {
+        for (uint8_t socket = 0; socket < 7; socket++)
+        {
+            if (_sockets & (1 << socket))
+            {
+                sprintf_P(line, PSTR("+NSOSTATUS: %d"), socket);
+                respond(line);
+            }
+        }
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("NSOSTF=")))
+    {
+        // NSOSTF=<socket>,"<ip>",<port>,<flag>,<length>,"<hex data>"
+        int socket = atoi(cmd + 7);
+        const char *fields[5] = { cmd + 7 };
+        for (uint8_t i = 1; i < 5 && fields[i - 1]; i++)
+        {
+            fields[i] = strchr(fields[i - 1], ',');
+            if (fields[i])
+            {
+                fields[i]++;
+            }
+        }
+        if (fields[4] == NULL || !(_sockets & (1 << socket)) || registrationStatus() != 1)
+        {
+            // Nothing can be sent without the network
+            respondError();
+            return;
+        }
+        long flag = strtol(fields[3], NULL, 16);
+        int length = atoi(fields[4]);
+        reportConnection(true);
+        sprintf_P(line, PSTR("%d,%d"), socket, length);
+        respond(line);
+        respondOK();
+
+        // Roughly 1 ms per byte on the air, plus the time to set up
+        _txTime += 20 + length;
+        _rxTime += 40;
+        if (flag == 0x200)
+        {
+            // Released right after the send
+            reportConnection(false);
+        }
+    }
+    else if (startsWith(cmd, PSTR("NSORF=")))
+    {
+        // NSORF=<socket>,<length>
+        int socket = atoi(cmd + 6);
+        const char *p = strchr(cmd, ',');
+        if (p == NULL || !(_sockets & (1 << socket)))
+        {
+            respondError();
+            return;
+        }
+        respondDownlink(socket, atoi(p + 1));
+    }
+    else if (startsWith(cmd, PSTR("NATSPEED=")))
+    {
+        // NATSPEED=<baud rate>,<timeout>,<store>
+        uint32_t baudRate = strtoul(cmd + 9, NULL, 10);
+        const char *p = strchr(cmd, ',');
+        const uint32_t supported[] = { 4800, 9600, 57600, 115200, 230400, 460800, 921600 };
+        bool valid = false;
+        for (uint8_t i = 0; i < sizeof(supported) / sizeof(supported[0]); i++)
+        {
+            valid |= baudRate == supported[i];
+        }
+        if (!valid)
+        {
+            respondError();
+            return;
+        }
+        _nextBaudRate = baudRate;
+        _speedTimeout = (p != NULL ? strtoul(p + 1, NULL, 10) : 3) * 1000000UL;
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("CSCON=")))
+    {
+        _connectionReports = atoi(cmd + 6) == 1;
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("NUESTATS")))
+    {
+        respond(F("Signal power:-783"));
+        respond(F("Total power:-680"));
+        respond(F("TX power:230"));
+        sprintf_P(line, PSTR("TX time:%lu"), (unsigned long)_txTime);
+        respond(line);
+        sprintf_P(line, PSTR("RX time:%lu"), (unsigned long)_rxTime);
+        respond(line);
+        respond(F("Cell ID:17389829"));
+        respond(F("ECL:0"));
+        respondOK();
+    }
+    else if (startsWith(cmd, PSTR("CMEE=")) || startsWith(cmd, PSTR("NCONFIG=")) ||
+        startsWith(cmd, PSTR("CGATT=")) || startsWith(cmd, PSTR("CEDRXS=")) ||
+        startsWith(cmd, PSTR("CPSMS=")))
+    {
+        respondOK();
+    }
+    else
+    {
+        respondError();
+    }
+}
@@ -0,0 +1,182 @@
+/**
+ * Simulated u-blox SARA N2 module for the benchmark example.
+ *
+ * The simulator is a Stream that can be passed to TelenorNBIoT::begin()
+ * instead of the serial port connected to a real module. It answers the AT
+ * commands used by the library with canned responses, delays every response
+ * by a configurable latency and paces the bytes in both directions according
+ * to the configured baud rate, so timings are roughly what you would see on
+ * the serial link to a real module. AT+NATSPEED changes the speed of the
+ * module side of the link, and begin() the speed of the host side. Nothing
+ * gets through while they differ. Several commands can be sent on one
+ * line, separated by semicolons, unless setJoinedCommands() says otherwise.
+ *
+ * It also counts AT round-trips and bytes on the wire in both directions.
+ *
+ * This example is in the public domain.
+ */
+#ifndef SIMULATED_MODEM_H
+#define SIMULATED_MODEM_H
+
+#include <Arduino.h>
+
+// Longest command line we keep (the hex payload of NSOSTF is not stored)
+#define SIM_CMD_SIZE 96
+// Largest response, including a hex encoded downlink datagram or the
+// answers to the queries of a warm start
+#define SIM_RESPONSE_SIZE 256
+// Largest downlink datagram that can be queued
+#define SIM_DOWNLINK_SIZE 64
+
+class SimulatedModem : public Stream
+{
+  public:
+    SimulatedModem(uint32_t baudRate = 9600, uint16_t latencyMs = 10);
+
+    /**
+     * Set the simulated baud rate for the serial link. The module starts at
+     * this speed when it reboots.
+     */
+    void setBaudRate(uint32_t baudRate);
+
+    /**
+     * Set the speed of the host side of the serial link, like
+     * HardwareSerial::begin().
+     */
+    void begin(uint32_t baudRate);
+
+    /**
+     * Set the highest speed the serial link can carry, f.e. because of long
+     * wires or a software serial port. Nothing gets through above it.
+     */
+    void setMaxBaudRate(uint32_t baudRate);
+
+    /**
+     * Accept several commands on one line, separated by semicolons, or
+     * answer such lines with ERROR, like some firmware versions do. They are
+     * accepted by default.
+     */
+    void setJoinedCommands(bool accepted);
+
+    /**
+     * Set the time the module uses before it starts responding to a command.
+     */
+    void setLatency(uint16_t latencyMs);
+
+    /**
+     * Set the time a reboot (AT+NRB) takes.
+     */
+    void setRebootTime(uint16_t rebootMs);
+
+    /**
+     * Make the network available or unavailable. The module registers when
+     * the network is available, and reports the change with a +CEREG URC if
+     * AT+CEREG=1 has been sent since it last rebooted.
+     */
+    void setNetworkAvailable(bool available);
+
+    /**
+     * Queue a datagram that will be returned by the next AT+NSORF. The module
+     * notifies the host with a +NSONMI URC.
+     */
+    bool queueDownlink(const char *data, uint16_t length, uint8_t socket = 0);
+
+    /**
+     * Number of AT commands the module has responded to.
+     */
+    uint16_t roundTrips();
+
+    /**
+     * Number of bytes written to the module.
+     */
+    uint32_t bytesReceived();
+
+    /**
+     * Number of bytes read from the module.
+     */
+    uint32_t bytesSent();
+
+    /**
+     * Number of command lines that didn't fit in SIM_CMD_SIZE and response
+     * lines that didn't fit in SIM_RESPONSE_SIZE since the module was
+     * created. Commands that don't fit are answered with ERROR, and lines
+     * that don't fit are left out, so the results can't be trusted when
+     * this isn't 0.
+     */
+    uint16_t overflows();
+
+    /**
+     * Reset the round-trip and byte counters.
+     */
+    void resetCounters();
+
+    size_t write(uint8_t c);
+    int available();
+    int read();
+    int peek();
+    void flush();
+
+  private:
+    uint32_t _baudRate;
+    uint32_t _storedBaudRate;
+    uint32_t _hostBaudRate;
+    uint32_t _maxBaudRate;
+    uint32_t _nextBaudRate;
+    uint32_t _previousBaudRate;
+    unsigned long _speedTimeout;
+    unsigned long _speedChanged;
+    uint16_t _latency;
+    uint16_t _rebootTime;
+    bool _joinedCommands;
+    unsigned long _byteTime;
+    unsigned long _txFree;
+
+    char _cmd[SIM_CMD_SIZE];
+    uint8_t _cmdLength;
+    bool _cmdOverflow;
+
+    char _response[SIM_RESPONSE_SIZE];
+    uint16_t _responseLength;
+    uint16_t _responsePos;
+    unsigned long _responseStart;
+    uint16_t _gapPos;
+    unsigned long _gap;
+
+    char _downlink[SIM_DOWNLINK_SIZE];
+    uint16_t _downlinkLength;
+    char _apn[30];
+    uint8_t _sockets;
+    bool _networkAvailable;
+    bool _radioOn;
+    bool _autoConnect;
+    char _operator[12];
+    bool _connectionReports;
+    bool _connected;
+    uint32_t _txTime;
+    uint32_t _rxTime;
+    bool _registrationReports;
+
+    uint16_t _roundTrips;
+    uint32_t _bytesReceived;
+    uint32_t _bytesSent;
+    uint16_t _overflows;
+
+    void setModuleSpeed(uint32_t baudRate);
+    void updateSpeed();
+    bool linkWorks();
+    uint16_t arrived();
+    void startResponse(unsigned long delayMicros);
+    void handleLine(char *line);
+    void handleCommand(const char *cmd);
+    void respond(const char *line);
+    void respond(const __FlashStringHelper *line);
+    void addLine(const char *line, uint16_t length, bool inFlash);
+    void respondOK();
+    void respondError();
+    void respondDownlink(int socket, uint16_t maxLength);
+    int registrationStatus();
+    void reportConnection(bool connected);
+    bool startsWith(const char *cmd, const char *prefix);
+};
+
+#endif
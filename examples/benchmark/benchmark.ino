@@ -0,0 +1,588 @@
+/***********************************************************************
+
+  Telenor NB-IoT benchmark
+
+  Runs the library against a simulated SARA N2 module and reports the
+  number of AT round-trips, bytes on the serial link and wall-clock time
+  for begin() (cold and warm start), sendBytes() and receiveBytes(), and
+  the time used to hex encode and decode payloads, the size of sensor
+  readings encoded with SeriesEncoder, reading the module status with one
+  command per value and with readStatus(), and estimates the energy
+  used for each power save mode. It also sends and receives a datagram at
+  each serial link speed the module supports. At the end it prints the
+  statistics collected by the library for each command type, and the RAM
+  used by the library for each of the predefined buffer sizes. No module or SIM card
+  is needed, so this can be used to measure the effect of changes to the
+  library on any board.
+
+  The simulated module paces the serial link according to the baud rate
+  and waits a configurable latency before it responds to each command.
+  The simulated module lives in the same RAM as the library, so together
+  they need more than the 2 KB of an Arduino Uno. Use a board like the
+  Arduino Mega, or run it on a computer with "make check" in extras/host.
+
+  This example is in the public domain.
+
+  Read more on the Exploratory Engineering team at
+  https://exploratory.engineering/
+
+***********************************************************************/
+
+#include <Udp.h>
+#include <TelenorNBIoT.h>
+#include "SimulatedModem.h"
+#include "hex.h"
+#include "timeseries.h"
+
+// Simulated module at 9600 baud which responds 10 ms after each command
+SimulatedModem modem(9600, 10);
+
+TelenorNBIoT nbiot;
+
+IPAddress remoteIP(172, 16, 15, 14);
+int REMOTE_PORT = 1234;
+
+char payload[200];
+char received[64];
+
+unsigned long started;
+
+TelenorNBIoT::statistics stats;
+
+// In the same order as TelenorNBIoT::command_type, kept in flash like the
+// other strings so they don't take RAM on AVR boards
+const char commandNames[] PROGMEM =
+  "CFUN\0NSOSTF\0NSORF\0NSOCR\0NSOCL\0CSQ\0CEREG\0CGATT\0"
+  "COPS\0CGDCONT\0NCONFIG\0NRB\0Queries\0Other";
+
+// In the same order as TelenorNBIoT::power_save_mode
+const char modeNames[] PROGMEM =
+  "psm_sleep_after_send\0psm_sleep_after_response\0psm_always_on";
+
+// Print the name at index in a list of names separated by NUL characters
+void printName(const char *names, uint8_t index) {
+  while (index-- > 0) {
+    names += strlen_P(names) + 1;
+  }
+  Serial.print((const __FlashStringHelper *)names);
+}
+
+// Output that discards everything written to it
+class NullOutput : public Print {
+  public:
+    size_t write(uint8_t c) { return 1; }
+    size_t write(const uint8_t *buffer, size_t size) { return size; }
+};
+
+NullOutput nullOutput;
+
+// The encoder used before writeHex(), for comparison. Two write() calls per
+// byte.
+void writeHexPerNibble(Print &out, const char *data, uint16_t length) {
+  for (int i = 0; i < length; i++) {
+    unsigned char ch1 = (data[i] & 0xF0) >> 4;
+    unsigned char ch2 = (data[i] & 0x0F);
+    ch1 = ch1 <= 9 ? '0' + ch1 : 'A' + ch1 - 10;
+    ch2 = ch2 <= 9 ? '0' + ch2 : 'A' + ch2 - 10;
+    out.write(ch1);
+    out.write(ch2);
+  }
+}
+
+void reportCycles(const __FlashStringHelper *name, unsigned long elapsedMicros, unsigned long bytes) {
+  Serial.print(name);
+  Serial.print(F(": "));
+  Serial.print(elapsedMicros);
+  Serial.print(F(" us, "));
+  Serial.print((float)elapsedMicros * (F_CPU / 1000000UL) / bytes);
+  Serial.println(F(" cycles per byte"));
+}
+
+void benchmarkHexEncoder() {
+  const uint8_t rounds = 20;
+
+  unsigned long start = micros();
+  for (uint8_t i = 0; i < rounds; i++) {
+    writeHexPerNibble(nullOutput, payload, sizeof(payload));
+  }
+  reportCycles(F("Per-nibble hex encoder"), micros() - start, (unsigned long)rounds * sizeof(payload));
+
+  start = micros();
+  for (uint8_t i = 0; i < rounds; i++) {
+    telenor_nbiot::writeHex(nullOutput, (const uint8_t *)payload, sizeof(payload));
+  }
+  reportCycles(F("Chunked hex encoder"), micros() - start, (unsigned long)rounds * sizeof(payload));
+}
+
+void startMeasurement() {
+  modem.resetCounters();
+  started = millis();
+}
+
+void report(const __FlashStringHelper *name, uint16_t size, bool success) {
+  unsigned long elapsed = millis() - started;
+  Serial.print(name);
+  if (size > 0) {
+    Serial.print(F(" ("));
+    Serial.print(size);
+    Serial.print(F(" bytes)"));
+  }
+  // The simulated module can't be trusted once its buffers have overflowed
+  Serial.print(success && modem.overflows() == 0 ? F(": ") : F(" FAILED: "));
+  Serial.print(modem.roundTrips());
+  Serial.print(F(" round-trips, "));
+  Serial.print(modem.bytesReceived());
+  Serial.print(F(" bytes out, "));
+  Serial.print(modem.bytesSent());
+  Serial.print(F(" bytes in, "));
+  Serial.print(elapsed);
+  Serial.println(F(" ms"));
+}
+
+void benchmarkSend(uint16_t size) {
+  startMeasurement();
+  bool success = nbiot.sendBytes(remoteIP, REMOTE_PORT, payload, size);
+  report(F("sendBytes()"), size, success);
+}
+
+// Send the largest datagram the module supports as a list of segments
+void benchmarkSendSegments() {
+  TelenorNBIoT::data_segment segments[4];
+  for (uint8_t i = 0; i < 4; i++) {
+    segments[i].data = payload;
+    segments[i].length = 128;
+  }
+  startMeasurement();
+  bool success = nbiot.sendBytes(remoteIP, REMOTE_PORT, segments, 4);
+  report(F("sendBytes() with 4 segments"), 512, success);
+}
+
+// The decoder used before HexDecoder, for comparison. Invalid digits are
+// decoded as 0.
+void hexToBytesPerNibble(const char *hex, const uint16_t byte_count, char *bytes) {
+  const uint16_t hex_count = byte_count*2;
+  for (int i=0; i<hex_count; i++) {
+    char c = hex[i];
+    if (c >= 48 && c <= 57) {
+      c -= 48;
+    } else if (c >= 65 && c <= 70) {
+      c -= 55;
+    } else if (c >= 97 && c <= 102) {
+      c -= 87;
+    } else {
+      c = 0;
+    }
+
+    if (i%2 == 0) {
+      bytes[i/2] = c << 4;
+    } else {
+      bytes[i/2] += c;
+    }
+  }
+}
+
+void benchmarkHexDecoder() {
+  const uint8_t rounds = 20;
+  const uint16_t size = sizeof(received);
+  static const char digits[] PROGMEM = "0123456789ABCDEF";
+  char hex[size * 2];
+  for (uint16_t i = 0; i < size; i++) {
+    hex[i * 2] = pgm_read_byte(&digits[(uint8_t)payload[i] >> 4]);
+    hex[i * 2 + 1] = pgm_read_byte(&digits[payload[i] & 0x0F]);
+  }
+
+  unsigned long start = micros();
+  for (uint8_t i = 0; i < rounds; i++) {
+    hexToBytesPerNibble(hex, size, received);
+  }
+  reportCycles(F("Per-nibble hex decoder"), micros() - start, (unsigned long)rounds * size);
+
+  start = micros();
+  bool valid = true;
+  HexDecoder decoder;
+  for (uint8_t i = 0; i < rounds; i++) {
+    decoder.begin(received, size);
+    for (uint16_t j = 0; j < sizeof(hex); j++) {
+      decoder.write(hex[j]);
+    }
+    valid &= decoder.isValid() && decoder.length() == size;
+  }
+  reportCycles(valid ? F("Table-driven hex decoder") : F("Table-driven hex decoder FAILED"), micros() - start, (unsigned long)rounds * size);
+
+  // The receive path writes the digits that have arrived in chunks, which
+  // are decoded a byte per step
+  start = micros();
+  for (uint8_t i = 0; i < rounds; i++) {
+    decoder.begin(received, size);
+    for (uint16_t j = 0; j < sizeof(hex); j += HEX_CHUNK_SIZE) {
+      decoder.write(hex + j, sizeof(hex) - j < HEX_CHUNK_SIZE ? sizeof(hex) - j : HEX_CHUNK_SIZE);
+    }
+    valid &= decoder.isValid() && decoder.length() == size && memcmp(received, payload, size) == 0;
+  }
+  reportCycles(valid ? F("Pairwise hex decoder") : F("Pairwise hex decoder FAILED"), micros() - start, (unsigned long)rounds * size);
+}
+
+// Number of characters used to print a value in decimal
+uint8_t decimalLength(int32_t value) {
+  uint8_t length = value < 0 ? 2 : 1;
+  uint32_t magnitude = value < 0 ? -(uint32_t)value : value;
+  while (magnitude >= 10) {
+    magnitude /= 10;
+    length++;
+  }
+  return length;
+}
+
+// Encode a trace of readings taken every minute with SeriesEncoder, and
+// compare the size with the same readings as comma separated text and as
+// 32 bit binary values. The values are computed from the reading number by
+// the trace function.
+void benchmarkSeries(const __FlashStringHelper *name, uint8_t fields, void (*trace)(uint16_t, int32_t *)) {
+  const uint16_t readings = 60;
+  // Room for the traces below, which are at most 359 bytes encoded
+  uint8_t buffer[384];
+  SeriesEncoder encoder;
+  encoder.begin(buffer, sizeof(buffer), fields);
+
+  int32_t values[SERIES_MAX_FIELDS];
+  uint32_t timestamp = 1533081600;
+  unsigned long textLength = 0;
+  for (uint16_t i = 0; i < readings; i++) {
+    trace(i, values);
+    encoder.add(timestamp + i * 60, values);
+    textLength += decimalLength(timestamp + i * 60) + 1;
+    for (uint8_t f = 0; f < fields; f++) {
+      textLength += decimalLength(values[f]) + 1;
+    }
+  }
+
+  // Check that the readings decode to what was encoded
+  SeriesDecoder decoder;
+  bool valid = decoder.begin((const uint8_t *)encoder.data(), encoder.length());
+  int32_t expected[SERIES_MAX_FIELDS];
+  uint16_t decoded = 0;
+  uint32_t decodedTime;
+  while (valid && decoder.next(decodedTime, values)) {
+    trace(decoded, expected);
+    valid = decodedTime == timestamp + decoded * 60 && memcmp(values, expected, fields * sizeof(int32_t)) == 0;
+    decoded++;
+  }
+  valid &= decoded == encoder.count() && encoder.count() == readings;
+
+  unsigned long binaryLength = (unsigned long)readings * (1 + fields) * 4;
+  Serial.print(name);
+  Serial.print(valid ? F(": ") : F(" FAILED: "));
+  Serial.print(encoder.count());
+  Serial.print(F(" readings, "));
+  Serial.print(encoder.length());
+  Serial.print(F(" bytes encoded, "));
+  Serial.print(textLength);
+  Serial.print(F(" as text ("));
+  Serial.print((float)textLength / encoder.length());
+  Serial.print(F("x), "));
+  Serial.print(binaryLength);
+  Serial.print(F(" as binary ("));
+  Serial.print((float)binaryLength / encoder.length());
+  Serial.println(F("x)"));
+}
+
+// Simple pseudo-random noise, the same on every board
+int32_t noise(uint16_t i, uint8_t field, int32_t range) {
+  uint32_t x = (uint32_t)i * 2654435761UL + field * 40503UL;
+  x ^= x >> 15;
+  return (int32_t)(x % (2 * range + 1)) - range;
+}
+
+// Temperature in hundredths of a degree, relative humidity in tenths of a
+// percent and air pressure in pascal, changing slowly
+void weatherTrace(uint16_t i, int32_t *values) {
+  values[0] = 1850 + (i < 30 ? i * 4 : (60 - i) * 4) + noise(i, 0, 3);
+  values[1] = 620 - i / 2 + noise(i, 1, 2);
+  values[2] = 101325 - i * 3 + noise(i, 2, 5);
+}
+
+// Acceleration in milli-g on three axes, mostly noise
+void vibrationTrace(uint16_t i, int32_t *values) {
+  values[0] = noise(i, 0, 200);
+  values[1] = noise(i, 1, 200);
+  values[2] = 1000 + noise(i, 2, 200);
+}
+
+// Read the identity and status of the module one value at a time, and with
+// readStatus(), which asks for them on one command line and keeps the ones
+// that don't change
+void benchmarkStatus() {
+  char imei[16], imsi[16], firmware[40];
+  startMeasurement();
+  bool success = nbiot.imei(imei, sizeof(imei)) && nbiot.imsi(imsi, sizeof(imsi)) &&
+    nbiot.firmwareVersion(firmware, sizeof(firmware));
+  nbiot.rssi();
+  success &= nbiot.registrationStatus() == TelenorNBIoT::RS_REGISTERED;
+  report(F("Status one value at a time"), 0, success);
+
+  TelenorNBIoT::module_status status;
+  startMeasurement();
+  success = nbiot.readStatus(status);
+  report(F("readStatus()"), 0, success);
+
+  startMeasurement();
+  success = nbiot.readStatus(status);
+  report(F("readStatus() again"), 0, success);
+
+  startMeasurement();
+  success = nbiot.readStatus(status, 0);
+  report(F("readStatus() with RSSI and registration read again"), 0, success);
+}
+
+// Send ten 8-byte readings with and without batching
+void benchmarkBatching() {
+  startMeasurement();
+  bool success = true;
+  for (uint8_t i = 0; i < 10; i++) {
+    success &= nbiot.sendBytes(remoteIP, REMOTE_PORT, payload, 8);
+  }
+  report(F("10 x sendBytes()"), 80, success);
+
+  char frame[96];
+  nbiot.enableBatching(frame, sizeof(frame), 60000);
+  startMeasurement();
+  for (uint8_t i = 0; i < 10; i++) {
+    success &= nbiot.sendBytes(remoteIP, REMOTE_PORT, payload, 8);
+  }
+  success &= nbiot.disableBatching();
+  report(F("10 x sendBytes() batched"), 80, success);
+}
+
+void benchmarkReceive(uint16_t size) {
+  // Wait for the module to notify about the datagram before measuring
+  modem.queueDownlink(payload, size);
+  unsigned long queued = millis();
+  while (size > 0 && nbiot.pendingDatagrams() == 0 && millis() - queued < 1000);
+
+  startMeasurement();
+  size_t length = nbiot.receiveBytes(received, sizeof(received));
+  report(F("receiveBytes()"), size, length == size);
+}
+
+// Send a few messages in each power save mode and print the estimated
+// radio time and charge
+void benchmarkEnergy() {
+  TelenorNBIoT::energy_stats energy;
+  nbiot.accountEnergy(&energy);
+  for (uint8_t mode = 0; mode < PSM_MODES; mode++) {
+    nbiot.powerSaveMode((TelenorNBIoT::power_save_mode)mode);
+    for (uint8_t i = 0; i < 3; i++) {
+      nbiot.sendBytes(remoteIP, REMOTE_PORT, payload, 64);
+      // Let the library see when the module disconnects
+      unsigned long sent = millis();
+      while (millis() - sent < 1000) {
+        nbiot.poll();
+      }
+    }
+  }
+  nbiot.updateEnergy();
+  nbiot.accountEnergy(NULL);
+
+  for (uint8_t mode = 0; mode < PSM_MODES; mode++) {
+    TelenorNBIoT::mode_energy &used = energy.modes[mode];
+    printName(modeNames, mode);
+    Serial.print(F(": "));
+    Serial.print(used.sends);
+    Serial.print(F(" sends, connected "));
+    Serial.print(used.connectedTime);
+    Serial.print(F(" ms, tx "));
+    Serial.print(used.txTime);
+    Serial.print(F(" ms, rx "));
+    Serial.print(used.rxTime);
+    Serial.print(F(" ms, "));
+    Serial.print(used.charge);
+    Serial.println(F(" uAh"));
+  }
+}
+
+// Change the host side of the simulated serial link, like
+// Serial1.begin(baudRate) would on a board
+void setModemSpeed(uint32_t baudRate) {
+  modem.begin(baudRate);
+}
+
+// Switch the serial link to each speed with AT+NATSPEED, and send and
+// receive a datagram at it
+void benchmarkSpeeds() {
+  const uint32_t speeds[] = { 9600, 57600, 115200, 230400, 460800, 921600 };
+  for (uint8_t i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++) {
+    nbiot.setSerialSpeed(speeds[i], setModemSpeed);
+    startMeasurement();
+    bool success = nbiot.begin(modem, false, true) && nbiot.serialSpeed() == speeds[i];
+    Serial.print(speeds[i]);
+    Serial.print(F(" baud: "));
+    report(F("begin() warm start"), 0, success);
+
+    startMeasurement();
+    success = nbiot.createSocket() && nbiot.sendBytes(remoteIP, REMOTE_PORT, payload, 200);
+    Serial.print(speeds[i]);
+    Serial.print(F(" baud: "));
+    report(F("sendBytes()"), 200, success);
+
+    Serial.print(speeds[i]);
+    Serial.print(F(" baud: "));
+    benchmarkReceive(64);
+  }
+
+  // Above what the wires can carry the library stays at 9600
+  nbiot.setSerialSpeed(9600, setModemSpeed);
+  nbiot.begin(modem, false, true);
+  modem.setMaxBaudRate(115200);
+  nbiot.setSerialSpeed(460800, setModemSpeed);
+  startMeasurement();
+  bool success = nbiot.begin(modem, false, true) && nbiot.serialSpeed() == 9600;
+  report(F("begin() with 460800 baud falling back to 9600"), 0, success);
+  modem.setMaxBaudRate(921600);
+}
+
+// Read datagrams with sendCommand() on the preset for the Uno, whose 64 byte
+// buffer has room for the first response line with 16 bytes of data, but
+// hardly for the OK after it, and not for the line with 32 bytes. The final
+// result must still be the last line.
+void benchmarkLongLines() {
+  TelenorNBIoTSlim slim;
+  bool success = slim.begin(modem, false, true) && slim.createSocket();
+  const uint16_t sizes[] = { 16, 32 };
+  for (uint8_t i = 0; i < 2; i++) {
+    modem.queueDownlink(payload, sizes[i]);
+    // The socket opened above is the only one on the module
+    char cmd[16];
+    sprintf_P(cmd, PSTR("NSORF=0,%u"), sizes[i]);
+    uint8_t lineCount = 0;
+    char last[8] = "";
+    startMeasurement();
+    bool sent = slim.sendCommand(cmd, [&lineCount, &last](TelenorNBIoT::command_status status, uint8_t count, char **lines) {
+      lineCount = status == TelenorNBIoT::cmd_ok ? count : 0;
+      if (count > 0) {
+        strncpy(last, lines[count - 1], sizeof(last) - 1);
+      }
+    });
+    while (sent && slim.poll() == TelenorNBIoT::cmd_pending);
+    report(F("sendCommand() on TelenorNBIoTSlim"), sizes[i], success && lineCount > 0 && last[0] == 'O');
+    Serial.print(F("  "));
+    Serial.print(lineCount);
+    Serial.print(F(" lines, the last one \""));
+    Serial.print(last);
+    Serial.println(slim.responseTruncated() ? F("\", truncated") : F("\""));
+  }
+}
+
+// Warm start on a module that doesn't take several commands on one line.
+// The library asks again one command at a time, and keeps doing that.
+void benchmarkSeparateQueries() {
+  modem.setJoinedCommands(false);
+  startMeasurement();
+  bool success = nbiot.begin(modem, false, true);
+  report(F("begin() warm start, one command per line"), 0, success);
+
+  startMeasurement();
+  success = nbiot.begin(modem, false, true);
+  report(F("begin() warm start, one command per line again"), 0, success);
+  modem.setJoinedCommands(true);
+}
+
+// Print the statistics the library has collected during the benchmark
+void printStats() {
+  Serial.println(F("Command statistics (latency histogram from 32 ms, doubling):"));
+  for (uint8_t type = 0; type < COMMAND_TYPES; type++) {
+    TelenorNBIoT::command_stats &command = stats.commands[type];
+    if (command.issued == 0) {
+      continue;
+    }
+    printName(commandNames, type);
+    Serial.print(F(": "));
+    Serial.print(command.issued);
+    Serial.print(F(" issued, "));
+    Serial.print(command.retries);
+    Serial.print(F(" retries, "));
+    Serial.print(command.timeouts);
+    Serial.print(F(" timeouts, "));
+    Serial.print(command.errors);
+    Serial.print(F(" errors, latency"));
+    for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+      Serial.print(' ');
+      Serial.print(command.latency[i]);
+    }
+    Serial.println();
+  }
+  Serial.print(F("Serial link: "));
+  Serial.print(stats.bytesWritten);
+  Serial.print(F(" bytes out, "));
+  Serial.print(stats.bytesRead);
+  Serial.println(F(" bytes in"));
+}
+
+void reportSize(const __FlashStringHelper *name, size_t size) {
+  Serial.print(F("sizeof("));
+  Serial.print(name);
+  Serial.print(F("): "));
+  Serial.print(size);
+  Serial.println(F(" bytes"));
+}
+
+// RAM used by an instance of the library with each of the predefined sizes
+void printSizes() {
+  reportSize(F("TelenorNBIoTSlim"), sizeof(TelenorNBIoTSlim));
+  reportSize(F("TelenorNBIoT"), sizeof(TelenorNBIoT));
+  reportSize(F("TelenorNBIoTLarge"), sizeof(TelenorNBIoTLarge));
+}
+
+void setup() {
+  Serial.begin(9600);
+  while (!Serial);
+
+  for (uint16_t i = 0; i < sizeof(payload); i++) {
+    payload[i] = i;
+  }
+
+  Serial.println(F("Benchmarking against a simulated module"));
+  nbiot.collectStats(&stats);
+
+  startMeasurement();
+  bool success = nbiot.begin(modem);
+  report(F("begin()"), 0, success);
+
+  // The module is already configured, so it isn't rebooted
+  startMeasurement();
+  success = nbiot.begin(modem, false, true);
+  report(F("begin() warm start"), 0, success);
+
+  startMeasurement();
+  success = nbiot.createSocket();
+  report(F("createSocket()"), 0, success);
+
+  benchmarkStatus();
+
+  benchmarkSend(16);
+  benchmarkSend(64);
+  benchmarkSend(200);
+  benchmarkSendSegments();
+  benchmarkBatching();
+
+  // Receiving when nothing is queued on the module
+  benchmarkReceive(0);
+  benchmarkReceive(16);
+  benchmarkReceive(64);
+
+  benchmarkHexEncoder();
+  benchmarkHexDecoder();
+  benchmarkSeries(F("Weather trace"), 3, weatherTrace);
+  benchmarkSeries(F("Vibration trace"), 3, vibrationTrace);
+  benchmarkEnergy();
+  benchmarkSpeeds();
+  benchmarkLongLines();
+  benchmarkSeparateQueries();
+
+  printStats();
+  printSizes();
+
+  Serial.println(F("Done"));
+}
+
+void loop() {
+}
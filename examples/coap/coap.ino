@@ -0,0 +1,102 @@
+/***********************************************************************
+
+  Telenor NB-IoT CoAP
+
+  Configures NB-IoT, connects and posts a reading to a CoAP server every
+  15 minutes, and reads a setting back from it.
+
+  This example is in the public domain.
+
+  Read more on the Exploratory Engineering team at
+  https://exploratory.engineering/
+
+***********************************************************************/
+
+#include <Udp.h>
+#include <TelenorNBIoT.h>
+#include <TelenorNBIoTUDP.h>
+#include <coap.h>
+
+#ifdef SERIAL_PORT_HARDWARE_OPEN
+/*
+ * For Arduino boards with a hardware serial port separate from USB serial.
+ * This is usually mapped to Serial1. Check which pins are used for Serial1 on
+ * the board you're using.
+ */
+#define ublox SERIAL_PORT_HARDWARE_OPEN
+#else
+/*
+ * For Arduino boards with only one hardware serial port (like Arduino UNO). It
+ * is mapped to USB, so we use SoftwareSerial on pin 10 and 11 instead.
+ */
+#include <SoftwareSerial.h>
+SoftwareSerial ublox(10, 11);
+#endif
+
+// Room for one socket and short responses, so this fits in the 2 KB of RAM
+// on an Arduino Uno
+TelenorNBIoTSlim nbiot;
+
+// UDP on a socket of its own, and the CoAP client on top of it. The packets
+// have room for a 64 byte block with the CoAP header and options.
+BasicTelenorNBIoTUDP<96, 96> udp(nbiot);
+CoapClient coap(udp);
+
+// The CoAP server. u-blox SARA N2 does not support DNS
+IPAddress serverIP(172, 16, 15, 14);
+
+// How often we want to send a reading, specified in milliseconds
+unsigned long INTERVAL_MS = (unsigned long) 15 * 60 * 1000;
+
+void setup() {
+  Serial.begin(9600);
+  while (!Serial);
+
+  ublox.begin(9600);
+
+  Serial.print(F("Connecting to NB-IoT module...\n"));
+  while (!nbiot.begin(ublox)) {
+    Serial.println(F("Begin failed. Retrying..."));
+    delay(1000);
+  }
+
+  // Responses come back to the local port
+  while (!udp.begin(5683)) {
+    Serial.print(F("Error opening socket. Error code: "));
+    Serial.println(nbiot.errorCode(), DEC);
+    delay(100);
+  }
+  coap.begin(serverIP);
+  coap.setContentFormat(0);  // text/plain
+}
+
+void loop() {
+  if (nbiot.isConnected()) {
+    char reading[16];
+    snprintf(reading, sizeof(reading), "%d", analogRead(A0));
+
+    // Confirmable requests are sent again until the server acknowledges them
+    if (coap.post("sensors/a0", reading, strlen(reading))) {
+      Serial.print(F("Posted, response code "));
+      Serial.print(coap.responseCode() >> 5);
+      Serial.print(F(".0"));
+      Serial.println(coap.responseCode() & 31);
+    } else {
+      Serial.println(F("No response from the server"));
+    }
+
+    // Longer responses are fetched in blocks
+    char setting[64];
+    if (coap.get("settings/interval", setting, sizeof(setting) - 1) &&
+        coap.responseCode() == COAP_CONTENT) {
+      setting[coap.responseLength() < sizeof(setting) - 1 ? coap.responseLength() : sizeof(setting) - 1] = 0;
+      Serial.print(F("Interval: "));
+      Serial.println(setting);
+    }
+
+    delay(INTERVAL_MS);
+  } else {
+    Serial.println(F("Connecting..."));
+    delay(5000);
+  }
+}
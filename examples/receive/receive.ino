@@ -41,6 +41,9 @@ int LOCAL_PORT = 1234;
 const uint16_t bufferLength = 16;
 char buffer[bufferLength];
 
+// Set when the module has received data
+bool dataReceived = false;
+
 void setup() {
   Serial.begin(9600);
   while (!Serial);
@@ -80,10 +83,23 @@ void setup() {
     delay(100);
   }
 
+  // The module notifies the library when data arrives. Read the data when
+  // the callback is invoked from nbiot.poll().
+  nbiot.onReceive([](int socket, uint8_t pendingDatagrams) {
+    dataReceived = true;
+  });
+
   Serial.println("Waiting for downstream messages");
 }
 
 void loop() {
+  // Check for notifications from the module
+  nbiot.poll();
+  if (!dataReceived) {
+    return;
+  }
+  dataReceived = false;
+
   // As long as received bytes are available
   while (int bytesReceived = nbiot.receiveBytes(buffer, bufferLength)) {
     Serial.print("Received data from ");
@@ -104,7 +120,4 @@ void loop() {
       Serial.println(remaining);
     }
   }
- 
-  // Wait 5 seconds
-  delay(5000);
 }
@@ -0,0 +1,72 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef HOST_IPADDRESS_H
+#define HOST_IPADDRESS_H
+
+#include <Arduino.h>
+
+class IPAddress : public Printable
+{
+  public:
+    IPAddress() { memset(_address, 0, sizeof(_address)); }
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+    {
+        _address[0] = a;
+        _address[1] = b;
+        _address[2] = c;
+        _address[3] = d;
+    }
+
+    uint8_t operator[](int index) const { return _address[index]; }
+    uint8_t &operator[](int index) { return _address[index]; }
+    bool operator==(const IPAddress &other) const { return memcmp(_address, other._address, 4) == 0; }
+    bool operator!=(const IPAddress &other) const { return !(*this == other); }
+
+    bool fromString(const char *text)
+    {
+        unsigned int parts[4];
+        char end;
+        if (sscanf(text, "%u.%u.%u.%u%c", &parts[0], &parts[1], &parts[2], &parts[3], &end) != 4)
+        {
+            return false;
+        }
+        for (uint8_t i = 0; i < 4; i++)
+        {
+            if (parts[i] > 255)
+            {
+                return false;
+            }
+            _address[i] = parts[i];
+        }
+        return true;
+    }
+
+    size_t printTo(Print &p) const
+    {
+        size_t n = 0;
+        for (uint8_t i = 0; i < 4; i++)
+        {
+            n += i > 0 ? p.print('.') : 0;
+            n += p.print(_address[i]);
+        }
+        return n;
+    }
+
+  private:
+    uint8_t _address[4];
+};
+
+#endif
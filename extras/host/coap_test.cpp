@@ -0,0 +1,421 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <coap.h>
+#include <vector>
+#include <deque>
+#include "test.h"
+
+// CoAP message types and options, as defined in RFC 7252 and RFC 7959
+#define CON 0
+#define NON 1
+#define ACK 2
+#define URI_PATH 11
+#define BLOCK2 23
+#define BLOCK1 27
+
+IPAddress serverIP(172, 16, 15, 14);
+
+typedef std::vector<uint8_t> packet;
+
+// A decoded CoAP message
+struct message
+{
+    uint8_t type = 0;
+    uint8_t code = 0;
+    uint16_t id = 0;
+    packet token;
+    std::string path;
+    long block1 = -1;
+    long block2 = -1;
+    packet payload;
+};
+
+static bool decode(const packet &data, message &msg)
+{
+    if (data.size() < 4 || data[0] >> 6 != 1)
+    {
+        return false;
+    }
+    msg.type = data[0] >> 4 & 3;
+    msg.code = data[1];
+    msg.id = data[2] << 8 | data[3];
+    size_t pos = 4 + (data[0] & 0x0F);
+    msg.token.assign(data.begin() + 4, data.begin() + pos);
+    uint16_t number = 0;
+    while (pos < data.size() && data[pos] != 0xFF)
+    {
+        // Only the short forms are used by the client for these options
+        uint16_t delta = data[pos] >> 4;
+        uint16_t length = data[pos++] & 0x0F;
+        if (delta == 13)
+        {
+            delta = 13 + data[pos++];
+        }
+        number += delta;
+        uint32_t value = 0;
+        for (uint16_t i = 0; i < length; i++)
+        {
+            value = value << 8 | data[pos + i];
+        }
+        if (number == URI_PATH)
+        {
+            msg.path += (msg.path.empty() ? "" : "/") + std::string(data.begin() + pos, data.begin() + pos + length);
+        }
+        else if (number == BLOCK1)
+        {
+            msg.block1 = value;
+        }
+        else if (number == BLOCK2)
+        {
+            msg.block2 = value;
+        }
+        pos += length;
+    }
+    if (pos < data.size())
+    {
+        msg.payload.assign(data.begin() + pos + 1, data.end());
+    }
+    return true;
+}
+
+static void addUintOption(packet &data, uint16_t number, uint16_t &last, uint32_t value)
+{
+    packet bytes;
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        if (!bytes.empty() || (value >> shift) & 0xFF)
+        {
+            bytes.push_back(value >> shift);
+        }
+    }
+    uint16_t delta = number - last;
+    data.push_back((delta < 13 ? delta : 13) << 4 | bytes.size());
+    if (delta >= 13)
+    {
+        data.push_back(delta - 13);
+    }
+    data.insert(data.end(), bytes.begin(), bytes.end());
+    last = number;
+}
+
+static packet encode(const message &msg)
+{
+    packet data = { (uint8_t)(0x40 | msg.type << 4 | msg.token.size()), msg.code, (uint8_t)(msg.id >> 8), (uint8_t)msg.id };
+    data.insert(data.end(), msg.token.begin(), msg.token.end());
+    uint16_t last = 0;
+    if (msg.block2 >= 0)
+    {
+        addUintOption(data, BLOCK2, last, msg.block2);
+    }
+    if (msg.block1 >= 0)
+    {
+        addUintOption(data, BLOCK1, last, msg.block1);
+    }
+    if (!msg.payload.empty())
+    {
+        data.push_back(0xFF);
+        data.insert(data.end(), msg.payload.begin(), msg.payload.end());
+    }
+    return data;
+}
+
+/**
+ * A CoAP server with two resources: "echo" takes a payload, in blocks if
+ * needed, and answers with its length, and "large" is a GET resource of
+ * LARGE_SIZE bytes, sent in blocks of 64 bytes.
+ */
+#define LARGE_SIZE 300
+
+class TestServer
+{
+  public:
+    // Requests to drop before answering, to make the client send again
+    uint8_t drop = 0;
+    // Acknowledge requests right away, and send the response separately
+    bool separate = false;
+    uint16_t requests = 0;
+    uint8_t lastType = 0;
+    packet received;
+
+    void handle(const packet &data, std::deque<packet> &replies)
+    {
+        message request;
+        if (!decode(data, request))
+        {
+            return;
+        }
+        requests++;
+        lastType = request.type;
+        if (request.code == 0)
+        {
+            // The acknowledgement of a separate response
+            return;
+        }
+        if (drop > 0)
+        {
+            drop--;
+            return;
+        }
+
+        message response;
+        response.type = request.type == CON ? ACK : NON;
+        response.id = request.id;
+        response.token = request.token;
+        if (request.path == "echo")
+        {
+            long block1 = request.block1;
+            if (block1 < 0 || block1 >> 4 == 0)
+            {
+                received.clear();
+            }
+            received.insert(received.end(), request.payload.begin(), request.payload.end());
+            response.block1 = block1;
+            if (block1 >= 0 && block1 & 8)
+            {
+                response.code = COAP_CONTINUE;
+            }
+            else
+            {
+                response.code = COAP_CHANGED;
+                std::string length = std::to_string(received.size());
+                response.payload.assign(length.begin(), length.end());
+            }
+        }
+        else if (request.path == "large")
+        {
+            uint32_t num = request.block2 >= 0 ? request.block2 >> 4 : 0;
+            uint8_t exponent = request.block2 >= 0 ? request.block2 & 7 : 2;
+            uint32_t size = 16 << exponent;
+            uint32_t offset = num * size;
+            uint32_t end = offset + size < LARGE_SIZE ? offset + size : LARGE_SIZE;
+            for (uint32_t i = offset; i < end; i++)
+            {
+                response.payload.push_back('a' + i % 26);
+            }
+            response.code = COAP_CONTENT;
+            response.block2 = num << 4 | (end < LARGE_SIZE ? 8 : 0) | exponent;
+        }
+        else
+        {
+            response.code = 0x84;
+        }
+
+        if (separate && request.type == CON)
+        {
+            message ack;
+            ack.type = ACK;
+            ack.id = request.id;
+            replies.push_back(encode(ack));
+            response.type = CON;
+            response.id = request.id + 0x1000;
+        }
+        replies.push_back(encode(response));
+    }
+};
+
+/**
+ * UDP that hands each packet straight to the test server, and reads its
+ * answers. Records the reply hints given by the client.
+ */
+class LoopbackUDP : public ReplyHintUDP
+{
+  public:
+    TestServer server;
+    uint8_t hints = 0;
+    bool replyExpected = false;
+
+    uint8_t begin(uint16_t port) { return 1; }
+    void stop() {}
+    int beginPacket(IPAddress ip, uint16_t port)
+    {
+        _tx.clear();
+        replyExpected = false;
+        return ip == serverIP && port == COAP_PORT;
+    }
+    int beginPacket(const char *host, uint16_t port) { return 0; }
+    void setReplyExpected(bool expected)
+    {
+        hints++;
+        replyExpected = expected;
+    }
+    int endPacket()
+    {
+        server.handle(_tx, _replies);
+        return 1;
+    }
+    size_t write(uint8_t c)
+    {
+        _tx.push_back(c);
+        return 1;
+    }
+    size_t write(const uint8_t *buffer, size_t size)
+    {
+        _tx.insert(_tx.end(), buffer, buffer + size);
+        return size;
+    }
+    int parsePacket()
+    {
+        if (_replies.empty())
+        {
+            return 0;
+        }
+        _rx = _replies.front();
+        _replies.pop_front();
+        _rxPos = 0;
+        return _rx.size();
+    }
+    int available() { return _rx.size() - _rxPos; }
+    int read() { return _rxPos < _rx.size() ? _rx[_rxPos++] : -1; }
+    int read(unsigned char *buffer, size_t length)
+    {
+        size_t count = 0;
+        while (count < length && _rxPos < _rx.size())
+        {
+            buffer[count++] = _rx[_rxPos++];
+        }
+        return count;
+    }
+    int read(char *buffer, size_t length) { return read((unsigned char *)buffer, length); }
+    int peek() { return _rxPos < _rx.size() ? _rx[_rxPos] : -1; }
+    void flush() {}
+    IPAddress remoteIP() { return serverIP; }
+    uint16_t remotePort() { return COAP_PORT; }
+
+  private:
+    packet _tx;
+    packet _rx;
+    size_t _rxPos = 0;
+    std::deque<packet> _replies;
+};
+
+// A confirmable request is answered in the acknowledgement
+void testConfirmable()
+{
+    LoopbackUDP udp;
+    CoapClient coap(udp);
+    coap.begin(serverIP);
+    char response[8] = "";
+    CHECK(coap.post("echo", "hello", 5, response, sizeof(response) - 1));
+    CHECK(udp.server.lastType == CON);
+    CHECK(coap.responseCode() == COAP_CHANGED);
+    CHECK(coap.responseLength() == 1 && response[0] == '5');
+    CHECK(coap.retransmissions() == 0);
+    CHECK(udp.hints == 1 && udp.replyExpected);
+}
+
+// A confirmable request that gets lost is sent again
+void testRetransmit()
+{
+    LoopbackUDP udp;
+    CoapClient coap(udp);
+    coap.begin(serverIP);
+    udp.server.drop = 2;
+    char response[8] = "";
+    unsigned long start = millis();
+    CHECK(coap.post("echo", "hello", 5, response, sizeof(response) - 1));
+    CHECK(coap.retransmissions() == 2);
+    CHECK(udp.server.requests == 3);
+    // Waits of 2 to 3 seconds, and then twice that
+    unsigned long elapsed = millis() - start;
+    CHECK(elapsed >= 3 * COAP_ACK_TIMEOUT && elapsed <= 3 * COAP_ACK_TIMEOUT * 3 / 2);
+
+    // Until it gives up
+    udp.server.drop = COAP_MAX_RETRANSMIT + 1;
+    CHECK(!coap.post("echo", "hello", 5, response, sizeof(response) - 1));
+    CHECK(coap.retransmissions() == COAP_MAX_RETRANSMIT);
+}
+
+// A response that comes after an empty acknowledgement is acknowledged
+void testSeparateResponse()
+{
+    LoopbackUDP udp;
+    CoapClient coap(udp);
+    coap.begin(serverIP);
+    udp.server.separate = true;
+    char response[8] = "";
+    CHECK(coap.post("echo", "hello", 5, response, sizeof(response) - 1));
+    CHECK(coap.responseCode() == COAP_CHANGED && response[0] == '5');
+    // The request and the acknowledgement of the response
+    CHECK(udp.server.requests == 2 && udp.server.lastType == ACK);
+}
+
+// A payload longer than the block size is sent in blocks
+void testBlock1()
+{
+    LoopbackUDP udp;
+    CoapClient coap(udp);
+    coap.begin(serverIP);
+    coap.setBlockSize(64);
+    char payload[200];
+    for (uint16_t i = 0; i < sizeof(payload); i++)
+    {
+        payload[i] = i;
+    }
+    char response[8] = "";
+    CHECK(coap.put("echo", payload, sizeof(payload), response, sizeof(response) - 1));
+    CHECK(udp.server.requests == 4);
+    CHECK(udp.server.received.size() == sizeof(payload));
+    CHECK(memcmp(udp.server.received.data(), payload, sizeof(payload)) == 0);
+    CHECK(coap.responseCode() == COAP_CHANGED && strcmp(response, "200") == 0);
+}
+
+// A response sent in blocks is put together in the response buffer
+void testBlock2()
+{
+    LoopbackUDP udp;
+    CoapClient coap(udp);
+    coap.begin(serverIP);
+    char response[LARGE_SIZE + 10];
+    CHECK(coap.get("large", response, sizeof(response)));
+    CHECK(coap.responseCode() == COAP_CONTENT);
+    CHECK(coap.responseLength() == LARGE_SIZE);
+    CHECK(udp.server.requests == 5);
+    bool same = true;
+    for (uint16_t i = 0; i < LARGE_SIZE; i++)
+    {
+        same &= response[i] == 'a' + i % 26;
+    }
+    CHECK(same);
+
+    // Blocks past the end of a short buffer aren't fetched
+    udp.server.requests = 0;
+    CHECK(coap.get("large", response, 100));
+    CHECK(udp.server.requests == 2);
+    CHECK(coap.responseLength() == 128);
+}
+
+// A non-confirmable request without a response buffer isn't answered
+void testNonConfirmable()
+{
+    LoopbackUDP udp;
+    CoapClient coap(udp);
+    coap.begin(serverIP);
+    coap.setConfirmable(false);
+    CHECK(coap.post("echo", "hello", 5));
+    CHECK(udp.server.lastType == NON);
+    CHECK(udp.hints == 1 && !udp.replyExpected);
+}
+
+int main()
+{
+    RUN_TEST(testConfirmable);
+    RUN_TEST(testRetransmit);
+    RUN_TEST(testSeparateResponse);
+    RUN_TEST(testBlock1);
+    RUN_TEST(testBlock2);
+    RUN_TEST(testNonConfirmable);
+    return testFailures > 0 ? 1 : 0;
+}
@@ -0,0 +1,83 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <hex.h>
+#include "test.h"
+
+static const char digits[] = "00FF7fa5c3";
+static const uint8_t bytes[] = { 0x00, 0xFF, 0x7F, 0xA5, 0xC3 };
+
+// Chunks of any length decode to the same bytes as single digits
+void testChunks()
+{
+    bool same = true;
+    for (size_t chunk = 1; chunk <= sizeof(digits); chunk++)
+    {
+        char out[sizeof(bytes)];
+        HexDecoder decoder;
+        decoder.begin(out, sizeof(out));
+        for (size_t i = 0; i < sizeof(digits) - 1; i += chunk)
+        {
+            size_t count = sizeof(digits) - 1 - i < chunk ? sizeof(digits) - 1 - i : chunk;
+            same &= decoder.write(digits + i, count);
+        }
+        same &= decoder.isValid() && decoder.length() == sizeof(bytes);
+        same &= memcmp(out, bytes, sizeof(bytes)) == 0;
+    }
+    CHECK(same);
+}
+
+// Invalid digits are reported, and the valid ones decoded as before
+void testInvalid()
+{
+    char single[4];
+    char pairs[4];
+    HexDecoder decoder;
+    decoder.begin(single, sizeof(single));
+    for (const char *c = "12g345"; *c != '\0'; c++)
+    {
+        decoder.write(*c);
+    }
+    CHECK(!decoder.isValid() && decoder.length() == 2);
+
+    decoder.begin(pairs, sizeof(pairs));
+    CHECK(!decoder.write("12g345", 6));
+    CHECK(!decoder.isValid() && decoder.length() == 2);
+    CHECK(memcmp(single, pairs, 2) == 0);
+
+    // An odd number of digits isn't whole bytes
+    decoder.begin(pairs, sizeof(pairs));
+    CHECK(decoder.write("123", 3));
+    CHECK(!decoder.isValid());
+}
+
+// Digits past the end of the buffer are skipped
+void testOverflow()
+{
+    char out[2];
+    HexDecoder decoder;
+    decoder.begin(out, sizeof(out));
+    CHECK(decoder.write("0102030405", 10));
+    CHECK(decoder.isValid() && decoder.length() == 2);
+    CHECK(out[0] == 1 && out[1] == 2);
+}
+
+int main()
+{
+    RUN_TEST(testChunks);
+    RUN_TEST(testInvalid);
+    RUN_TEST(testOverflow);
+    return testFailures > 0 ? 1 : 0;
+}
@@ -0,0 +1,70 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <Arduino.h>
+
+HostSerial Serial;
+
+// Simulated time in microseconds
+static unsigned long long now = 0;
+
+size_t HostSerial::write(uint8_t c)
+{
+    return fputc(c, stdout) == EOF ? 0 : 1;
+}
+
+unsigned long micros()
+{
+    // Reading the clock takes a little time, so loops that wait for it end
+    now += 2;
+    return (unsigned long)now;
+}
+
+unsigned long millis()
+{
+    now += 2;
+    return (unsigned long)(now / 1000);
+}
+
+void delay(unsigned long ms)
+{
+    now += ms * 1000ULL;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    now += us;
+}
+
+// Sketches may define their own, like on a board
+__attribute__((weak)) void yield()
+{
+    now += 1;
+}
+
+long random(long max)
+{
+    return max > 0 ? rand() % max : 0;
+}
+
+long random(long min, long max)
+{
+    return min + random(max - min);
+}
+
+void randomSeed(unsigned long seed)
+{
+    srand(seed);
+}
@@ -0,0 +1,103 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <TelenorNBIoT.h>
+#include "SimulatedModem.h"
+#include "test.h"
+
+#define QUEUE_FILE "build/queue_test.bin"
+
+IPAddress remoteIP(172, 16, 15, 14);
+
+// A queue in a file is picked up again when the file is opened again
+void testFileStorage()
+{
+    remove(QUEUE_FILE);
+    {
+        FileQueueStorage storage(QUEUE_FILE, 128);
+        UplinkQueue queue;
+        CHECK(queue.begin(storage));
+        CHECK(queue.count() == 0);
+        queued_datagram datagram = { 1234, { 172, 16, 15, 14 }, 4321, 5 };
+        CHECK(queue.beginPush(datagram) && queue.write("hello", 5) && queue.endPush());
+        datagram.length = 3;
+        CHECK(queue.beginPush(datagram) && queue.write("bye", 3) && queue.endPush());
+    }
+    {
+        FileQueueStorage storage(QUEUE_FILE, 128);
+        UplinkQueue queue;
+        CHECK(queue.begin(storage));
+        CHECK(queue.count() == 2);
+        queued_datagram datagram;
+        char data[5];
+        CHECK(queue.peek(datagram));
+        CHECK(datagram.listenPort == 1234 && datagram.port == 4321 && datagram.length == 5);
+        CHECK(datagram.ip[0] == 172 && datagram.ip[3] == 14);
+        CHECK(queue.read(0, data, 5) && memcmp(data, "hello", 5) == 0);
+        CHECK(queue.pop());
+    }
+    {
+        FileQueueStorage storage(QUEUE_FILE, 128);
+        UplinkQueue queue;
+        CHECK(queue.begin(storage));
+        CHECK(queue.count() == 1);
+        char data[3];
+        CHECK(queue.read(0, data, 3) && memcmp(data, "bye", 3) == 0);
+    }
+}
+
+// Datagrams queued before a restart wait until the socket is opened again,
+// and are then sent from it
+void testQueueOverRestart()
+{
+    SimulatedModem modem(115200, 1);
+    remove(QUEUE_FILE);
+    {
+        FileQueueStorage storage(QUEUE_FILE, 128);
+        UplinkQueue queue;
+        TelenorNBIoT nbiot;
+        CHECK(queue.begin(storage));
+        CHECK(nbiot.begin(modem) && nbiot.createSocket());
+        CHECK(nbiot.enableQueue(queue));
+        modem.setNetworkAvailable(false);
+        CHECK(nbiot.sendBytes(remoteIP, 1234, "hello", 5));
+        CHECK(nbiot.queuedDatagrams() == 1);
+    }
+
+    modem.setNetworkAvailable(true);
+    FileQueueStorage storage(QUEUE_FILE, 128);
+    UplinkQueue queue;
+    TelenorNBIoT nbiot;
+    CHECK(queue.begin(storage));
+    CHECK(nbiot.begin(modem));
+    CHECK(nbiot.enableQueue(queue));
+    nbiot.poll();
+    CHECK(nbiot.queuedDatagrams() == 1);
+
+    CHECK(nbiot.createSocket());
+    modem.resetCounters();
+    nbiot.poll();
+    while (nbiot.poll() == TelenorNBIoT::cmd_pending);
+    CHECK(nbiot.queuedDatagrams() == 0);
+    CHECK(modem.roundTrips() == 1);
+}
+
+int main()
+{
+    RUN_TEST(testFileStorage);
+    RUN_TEST(testQueueOverRestart);
+    remove(QUEUE_FILE);
+    return testFailures > 0 ? 1 : 0;
+}
@@ -0,0 +1,140 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "hex.h"
+
+static const char hexDigits[] = "0123456789ABCDEF";
+
+void telenor_nbiot::writeHex(Print &out, const uint8_t *data, size_t length)
+{
+    uint8_t chunk[HEX_CHUNK_SIZE];
+    while (length > 0)
+    {
+        size_t count = length < HEX_CHUNK_SIZE / 2 ? length : HEX_CHUNK_SIZE / 2;
+        uint8_t *p = chunk;
+        for (size_t i = 0; i < count; i++)
+        {
+            uint8_t b = data[i];
+            *p++ = hexDigits[b >> 4];
+            *p++ = hexDigits[b & 0x0F];
+        }
+        out.write(chunk, count * 2);
+        data += count;
+        length -= count;
+    }
+}
+
+#define HEX_INVALID 0xFF
+
+// Value of each character from '0' to 'f', HEX_INVALID for non-hex characters
+static const uint8_t hexValues[] PROGMEM = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+    HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID,
+    10, 11, 12, 13, 14, 15,
+    HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID,
+    HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID,
+    HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID, HEX_INVALID,
+    HEX_INVALID, HEX_INVALID,
+    10, 11, 12, 13, 14, 15,
+};
+
+static inline uint8_t hexNibble(char c)
+{
+    uint8_t index = (uint8_t)(c - '0');
+    if (index >= sizeof hexValues)
+    {
+        return HEX_INVALID;
+    }
+    return pgm_read_byte(hexValues + index);
+}
+
+void HexDecoder::begin(char *out, size_t size)
+{
+    _out = out;
+    _size = size;
+    _length = 0;
+    _lowNibble = false;
+    _valid = true;
+}
+
+bool HexDecoder::write(char c)
+{
+    uint8_t nibble = hexNibble(c);
+    if (nibble == HEX_INVALID)
+    {
+        _valid = false;
+        return false;
+    }
+    if (_length >= _size)
+    {
+        return true;
+    }
+    if (_lowNibble)
+    {
+        _out[_length++] |= nibble;
+    }
+    else
+    {
+        _out[_length] = nibble << 4;
+    }
+    _lowNibble = !_lowNibble;
+    return true;
+}
+
+bool HexDecoder::write(const char *digits, size_t count)
+{
+    bool valid = true;
+    if (_lowNibble && count > 0)
+    {
+        // Finish the byte left over from the previous chunk
+        valid = write(*digits++);
+        count--;
+    }
+    for (; count >= 2; count -= 2, digits += 2)
+    {
+        uint8_t high = hexNibble(digits[0]);
+        uint8_t low = hexNibble(digits[1]);
+        // HEX_INVALID has the upper bits set, so one check covers both
+        if ((high | low) & 0xF0)
+        {
+            // Malformed data is dropped anyway, so decode the rest a digit
+            // at a time to keep the same result
+            while (count-- > 0)
+            {
+                valid = write(*digits++) && valid;
+            }
+            return valid;
+        }
+        if (_length < _size)
+        {
+            _out[_length++] = high << 4 | low;
+        }
+    }
+    if (count > 0)
+    {
+        valid = write(*digits) && valid;
+    }
+    return valid;
+}
+
+size_t HexDecoder::length()
+{
+    return _length;
+}
+
+bool HexDecoder::isValid()
+{
+    return _valid && !_lowNibble;
+}
@@ -0,0 +1,79 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef TELENOR_NBIOT_HEX_H
+#define TELENOR_NBIOT_HEX_H
+
+#include <Arduino.h>
+
+// Number of hex digits encoded on the stack before they are written
+#define HEX_CHUNK_SIZE 32
+
+namespace telenor_nbiot
+{
+    /**
+     * Write data as upper case hex digits. The digits are encoded in chunks
+     * on the stack and written with a single call to Print::write() per
+     * chunk.
+     */
+    void writeHex(Print &out, const uint8_t *data, size_t length);
+}
+
+/**
+ * Decodes hex digits as they arrive, straight into the output buffer, with a
+ * lookup table that also tells invalid digits apart. Digits can be written
+ * one at a time, or in chunks that are decoded a byte per step. Upper and
+ * lower case digits are accepted. Digits that don't fit in the buffer are
+ * skipped.
+ */
+class HexDecoder
+{
+  public:
+    /**
+     * Start decoding into a new buffer.
+     */
+    void begin(char *out, size_t size);
+
+    /**
+     * Decode a hex digit. Returns false if it isn't a valid hex digit.
+     */
+    bool write(char c);
+
+    /**
+     * Decode count hex digits, two per step. Returns false if any of them
+     * isn't a valid hex digit.
+     */
+    bool write(const char *digits, size_t count);
+
+    /**
+     * Number of bytes decoded so far.
+     */
+    size_t length();
+
+    /**
+     * Returns true if all digits so far were valid and they make up whole
+     * bytes.
+     */
+    bool isValid();
+
+  private:
+    char *_out;
+    size_t _size;
+    size_t _length;
+    bool _lowNibble;
+    bool _valid;
+};
+
+#endif
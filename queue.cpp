@@ -0,0 +1,304 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "queue.h"
+
+// Marks storage that holds a queue, and the version of the layout
+#define QUEUE_MAGIC 0x5132
+
+static void putUint16(uint8_t *p, uint16_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static void putUint32(uint8_t *p, uint32_t value)
+{
+    putUint16(p, value);
+    putUint16(p + 2, value >> 16);
+}
+
+static uint16_t getUint16(const uint8_t *p)
+{
+    return p[0] | (uint16_t)p[1] << 8;
+}
+
+static uint32_t getUint32(const uint8_t *p)
+{
+    return getUint16(p) | (uint32_t)getUint16(p + 2) << 16;
+}
+
+RamQueueStorage::RamQueueStorage(uint8_t *buffer, uint32_t size)
+{
+    _buffer = buffer;
+    _size = size;
+}
+
+uint32_t RamQueueStorage::size()
+{
+    return _size;
+}
+
+bool RamQueueStorage::read(uint32_t address, uint8_t *data, uint16_t length)
+{
+    memcpy(data, _buffer + address, length);
+    return true;
+}
+
+bool RamQueueStorage::write(uint32_t address, const uint8_t *data, uint16_t length)
+{
+    memcpy(_buffer + address, data, length);
+    return true;
+}
+
+#ifdef ARDUINO_ARCH_AVR
+#include <EEPROM.h>
+
+EEPROMQueueStorage::EEPROMQueueStorage(uint16_t start, uint16_t size)
+{
+    _start = start;
+    _size = size;
+}
+
+uint32_t EEPROMQueueStorage::size()
+{
+    return _size;
+}
+
+bool EEPROMQueueStorage::read(uint32_t address, uint8_t *data, uint16_t length)
+{
+    for (uint16_t i = 0; i < length; i++)
+    {
+        data[i] = EEPROM.read(_start + address + i);
+    }
+    return true;
+}
+
+bool EEPROMQueueStorage::write(uint32_t address, const uint8_t *data, uint16_t length)
+{
+    for (uint16_t i = 0; i < length; i++)
+    {
+        EEPROM.update(_start + address + i, data[i]);
+    }
+    return true;
+}
+#endif
+
+#ifndef ARDUINO
+FileQueueStorage::FileQueueStorage(const char *path, uint32_t size)
+{
+    _size = size;
+    _file = fopen(path, "r+b");
+    if (_file == NULL)
+    {
+        _file = fopen(path, "w+b");
+    }
+}
+
+FileQueueStorage::~FileQueueStorage()
+{
+    if (_file != NULL)
+    {
+        fclose(_file);
+    }
+}
+
+uint32_t FileQueueStorage::size()
+{
+    return _file != NULL ? _size : 0;
+}
+
+bool FileQueueStorage::read(uint32_t address, uint8_t *data, uint16_t length)
+{
+    if (fseek(_file, address, SEEK_SET) != 0)
+    {
+        return false;
+    }
+    // Parts of the file that haven't been written yet read as zeros
+    size_t found = fread(data, 1, length, _file);
+    memset(data + found, 0, length - found);
+    return true;
+}
+
+bool FileQueueStorage::write(uint32_t address, const uint8_t *data, uint16_t length)
+{
+    return fseek(_file, address, SEEK_SET) == 0 &&
+        fwrite(data, 1, length, _file) == length &&
+        fflush(_file) == 0;
+}
+#endif
+
+bool UplinkQueue::begin(QueueStorage &storage)
+{
+    _storage = &storage;
+    _pushLength = 0;
+    if (storage.size() < QUEUE_HEADER_SIZE + QUEUE_RECORD_SIZE)
+    {
+        _storage = NULL;
+        return false;
+    }
+    _capacity = storage.size() - QUEUE_HEADER_SIZE;
+
+    // <magic> <head> <used> <count>
+    uint8_t header[QUEUE_HEADER_SIZE];
+    if (storage.read(0, header, sizeof(header)) && getUint16(header) == QUEUE_MAGIC)
+    {
+        _head = getUint32(header + 2);
+        _used = getUint32(header + 6);
+        _count = getUint16(header + 10);
+        if (_head < _capacity && _used <= _capacity && _count <= _used / QUEUE_RECORD_SIZE)
+        {
+            return true;
+        }
+    }
+    return clear();
+}
+
+bool UplinkQueue::clear()
+{
+    _head = 0;
+    _used = 0;
+    _count = 0;
+    _pushLength = 0;
+    return save();
+}
+
+uint16_t UplinkQueue::count()
+{
+    return _count;
+}
+
+uint32_t UplinkQueue::available()
+{
+    return _capacity - _used;
+}
+
+bool UplinkQueue::save()
+{
+    if (_storage == NULL)
+    {
+        return false;
+    }
+    uint8_t header[QUEUE_HEADER_SIZE];
+    putUint16(header, QUEUE_MAGIC);
+    putUint32(header + 2, _head);
+    putUint32(header + 6, _used);
+    putUint16(header + 10, _count);
+    return _storage->write(0, header, sizeof(header));
+}
+
+bool UplinkQueue::readAt(uint32_t position, uint8_t *data, uint16_t length)
+{
+    // The position is relative to the head and wraps around at the end
+    position = (_head + position) % _capacity;
+    uint16_t first = _capacity - position < length ? _capacity - position : length;
+    return _storage->read(QUEUE_HEADER_SIZE + position, data, first) &&
+        (first == length || _storage->read(QUEUE_HEADER_SIZE, data + first, length - first));
+}
+
+bool UplinkQueue::writeAt(uint32_t position, const uint8_t *data, uint16_t length)
+{
+    position = (_head + position) % _capacity;
+    uint16_t first = _capacity - position < length ? _capacity - position : length;
+    return _storage->write(QUEUE_HEADER_SIZE + position, data, first) &&
+        (first == length || _storage->write(QUEUE_HEADER_SIZE, data + first, length - first));
+}
+
+bool UplinkQueue::beginPush(const queued_datagram &datagram)
+{
+    _pushLength = 0;
+    if (_storage == NULL || _count == 0xFFFF || QUEUE_RECORD_SIZE + (uint32_t)datagram.length > available())
+    {
+        return false;
+    }
+
+    // <listen port> <ip> <port> <length> <data>
+    uint8_t record[QUEUE_RECORD_SIZE];
+    putUint16(record, datagram.listenPort);
+    memcpy(record + 2, datagram.ip, 4);
+    putUint16(record + 6, datagram.port);
+    putUint16(record + 8, datagram.length);
+    if (!writeAt(_used, record, sizeof(record)))
+    {
+        return false;
+    }
+    _pushStart = _used;
+    _pushWritten = QUEUE_RECORD_SIZE;
+    _pushLength = QUEUE_RECORD_SIZE + datagram.length;
+    return true;
+}
+
+bool UplinkQueue::write(const char *data, uint16_t length)
+{
+    if (_pushLength == 0 || _pushWritten + length > _pushLength ||
+        !writeAt(_pushStart + _pushWritten, (const uint8_t *)data, length))
+    {
+        _pushLength = 0;
+        return false;
+    }
+    _pushWritten += length;
+    return true;
+}
+
+bool UplinkQueue::endPush()
+{
+    if (_pushLength == 0 || _pushWritten != _pushLength)
+    {
+        _pushLength = 0;
+        return false;
+    }
+    _used += _pushLength;
+    _count++;
+    _pushLength = 0;
+    return save();
+}
+
+bool UplinkQueue::peek(queued_datagram &datagram)
+{
+    uint8_t record[QUEUE_RECORD_SIZE];
+    if (_count == 0 || !readAt(0, record, sizeof(record)))
+    {
+        return false;
+    }
+    datagram.listenPort = getUint16(record);
+    memcpy(datagram.ip, record + 2, 4);
+    datagram.port = getUint16(record + 6);
+    datagram.length = getUint16(record + 8);
+    return true;
+}
+
+bool UplinkQueue::read(uint16_t offset, char *data, uint16_t length)
+{
+    return _count > 0 && readAt(QUEUE_RECORD_SIZE + offset, (uint8_t *)data, length);
+}
+
+bool UplinkQueue::pop()
+{
+    queued_datagram datagram;
+    if (!peek(datagram))
+    {
+        return false;
+    }
+    uint32_t length = QUEUE_RECORD_SIZE + datagram.length;
+    if (length > _used)
+    {
+        // The storage has been corrupted
+        return clear();
+    }
+    _head = (_head + length) % _capacity;
+    _used -= length;
+    _count--;
+    return save();
+}
@@ -0,0 +1,182 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef TELENOR_NBIOT_QUEUE_H
+#define TELENOR_NBIOT_QUEUE_H
+
+#include <Arduino.h>
+
+// Bytes at the start of the storage used for the state of the queue
+#define QUEUE_HEADER_SIZE 12
+// Bytes stored with each datagram in addition to the data
+#define QUEUE_RECORD_SIZE 10
+
+/**
+ * Where the queue is kept. Implement this for other kinds of storage, f.e.
+ * an external flash chip. Addresses are from 0 to size() - 1, and reads and
+ * writes never go past the end.
+ */
+class QueueStorage
+{
+  public:
+    virtual uint32_t size() = 0;
+    virtual bool read(uint32_t address, uint8_t *data, uint16_t length) = 0;
+    virtual bool write(uint32_t address, const uint8_t *data, uint16_t length) = 0;
+};
+
+/**
+ * Keeps the queue in a buffer in RAM. The queue is lost when the board
+ * restarts.
+ */
+class RamQueueStorage : public QueueStorage
+{
+  public:
+    RamQueueStorage(uint8_t *buffer, uint32_t size);
+    uint32_t size();
+    bool read(uint32_t address, uint8_t *data, uint16_t length);
+    bool write(uint32_t address, const uint8_t *data, uint16_t length);
+
+  private:
+    uint8_t *_buffer;
+    uint32_t _size;
+};
+
+#ifdef ARDUINO_ARCH_AVR
+/**
+ * Keeps the queue in the EEPROM of AVR boards, from the start address and
+ * the given number of bytes on. Only bytes that change are written, but
+ * keep in mind that EEPROM wears out after about 100 000 writes.
+ */
+class EEPROMQueueStorage : public QueueStorage
+{
+  public:
+    EEPROMQueueStorage(uint16_t start, uint16_t size);
+    uint32_t size();
+    bool read(uint32_t address, uint8_t *data, uint16_t length);
+    bool write(uint32_t address, const uint8_t *data, uint16_t length);
+
+  private:
+    uint16_t _start;
+    uint16_t _size;
+};
+#endif
+
+#ifndef ARDUINO
+#include <stdio.h>
+
+/**
+ * Keeps the queue in a file of the given size, for testing on a computer.
+ * The file is created if it doesn't exist.
+ */
+class FileQueueStorage : public QueueStorage
+{
+  public:
+    FileQueueStorage(const char *path, uint32_t size);
+    ~FileQueueStorage();
+    uint32_t size();
+    bool read(uint32_t address, uint8_t *data, uint16_t length);
+    bool write(uint32_t address, const uint8_t *data, uint16_t length);
+
+  private:
+    FILE *_file;
+    uint32_t _size;
+};
+#endif
+
+/**
+ * Destination and length of a queued datagram.
+ */
+struct queued_datagram {
+    // Listen port of the socket it is sent from. The socket numbers aren't
+    // known after a restart, but the sketch opens the same ports again.
+    uint16_t listenPort;
+    uint8_t ip[4];
+    uint16_t port;
+    uint16_t length;
+};
+
+/**
+ * A ring buffer of datagrams waiting to be sent, oldest first. The state of
+ * the queue is kept in the storage along with the datagrams, so a queue in
+ * EEPROM or flash is picked up again after a restart.
+ */
+class UplinkQueue
+{
+  public:
+    /**
+     * Use the storage for the queue. Datagrams already queued in it are kept
+     * if the storage holds a valid queue, otherwise it starts out empty.
+     * Returns false if the storage is too small.
+     */
+    bool begin(QueueStorage &storage);
+
+    /**
+     * Remove all datagrams.
+     */
+    bool clear();
+
+    /**
+     * Number of datagrams in the queue.
+     */
+    uint16_t count();
+
+    /**
+     * Bytes free for datagrams, including the QUEUE_RECORD_SIZE bytes
+     * stored with each of them.
+     */
+    uint32_t available();
+
+    /**
+     * Add a datagram at the end of the queue. The data is written with
+     * write() after beginPush(), and the datagram is only added to the queue
+     * by endPush(), when all of it has been written. beginPush() returns
+     * false if the datagram doesn't fit.
+     */
+    bool beginPush(const queued_datagram &datagram);
+    bool write(const char *data, uint16_t length);
+    bool endPush();
+
+    /**
+     * Get the destination and length of the oldest datagram. Returns false
+     * if the queue is empty.
+     */
+    bool peek(queued_datagram &datagram);
+
+    /**
+     * Read part of the data of the oldest datagram.
+     */
+    bool read(uint16_t offset, char *data, uint16_t length);
+
+    /**
+     * Remove the oldest datagram.
+     */
+    bool pop();
+
+  private:
+    QueueStorage *_storage = NULL;
+    uint32_t _capacity = 0;
+    uint32_t _head = 0;
+    uint32_t _used = 0;
+    uint16_t _count = 0;
+    uint32_t _pushStart = 0;
+    uint32_t _pushWritten = 0;
+    uint32_t _pushLength = 0;
+
+    bool readAt(uint32_t position, uint8_t *data, uint16_t length);
+    bool writeAt(uint32_t position, const uint8_t *data, uint16_t length);
+    bool save();
+};
+
+#endif
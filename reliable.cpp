@@ -0,0 +1,292 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "reliable.h"
+
+#define RELIABLE_HEADER_SIZE 3
+#define RELIABLE_ACK_SIZE 5
+
+ReliableLinkBase::ReliableLinkBase(TelenorNBIoTBase &nbiot, reliable_slot *slots, uint8_t window, char *storage, uint16_t payloadSize)
+    : _nbiot(nbiot)
+{
+    _slots = slots;
+    _window = window;
+    _storage = storage;
+    _payloadSize = payloadSize;
+}
+
+bool ReliableLinkBase::begin(uint16_t localPort, IPAddress remoteIP, uint16_t remotePort)
+{
+    stop();
+    _socket = _nbiot.openSocket(localPort);
+    if (_socket < 0)
+    {
+        return false;
+    }
+    _remoteIP = remoteIP;
+    _remotePort = remotePort;
+    // Start somewhere else after a restart, so the server doesn't take new
+    // datagrams for old ones
+    _nextSequence = random(0x10000);
+    _rttMeasured = false;
+    _rto = RELIABLE_INITIAL_RTO;
+    _delivered = 0;
+    _retransmissions = 0;
+    _lost = 0;
+    return true;
+}
+
+void ReliableLinkBase::stop()
+{
+    for (uint8_t i = 0; i < _window; i++)
+    {
+        if (_slots[i].used)
+        {
+            complete(i, false);
+        }
+    }
+    if (_socket >= 0)
+    {
+        _nbiot.closeSocket(_socket);
+        _socket = -1;
+    }
+}
+
+long ReliableLinkBase::send(const char *data, uint16_t length)
+{
+    if (_socket < 0 || length > _payloadSize)
+    {
+        return -1;
+    }
+    uint8_t slot = 0;
+    while (slot < _window && _slots[slot].used)
+    {
+        slot++;
+    }
+    if (slot == _window)
+    {
+        return -1;
+    }
+
+    reliable_slot &state = _slots[slot];
+    state.used = true;
+    state.sequence = _nextSequence++;
+    state.length = length;
+    state.transmissions = 0;
+    memcpy(_storage + slot * _payloadSize, data, length);
+    transmit(slot);
+    return state.sequence;
+}
+
+bool ReliableLinkBase::transmit(uint8_t slot)
+{
+    reliable_slot &state = _slots[slot];
+    char header[RELIABLE_HEADER_SIZE] = { RELIABLE_DATA, (char)(state.sequence >> 8), (char)state.sequence };
+    TelenorNBIoTBase::data_segment segments[2] = {
+        { header, RELIABLE_HEADER_SIZE },
+        { _storage + slot * _payloadSize, state.length }
+    };
+
+    // Keep the radio up until the acknowledgement has arrived
+    bool sent = _nbiot.sendBytes(_socket, _remoteIP, _remotePort, segments, 2, _nbiot.releaseFor(_socket, true));
+
+    // The timeout doubles for each retransmission
+    state.transmissions++;
+    state.sentAt = millis();
+    state.timeout = _rto << (state.transmissions - 1);
+    if (state.timeout > RELIABLE_MAX_RTO)
+    {
+        state.timeout = RELIABLE_MAX_RTO;
+    }
+    return sent;
+}
+
+void ReliableLinkBase::poll()
+{
+    if (_socket < 0)
+    {
+        return;
+    }
+    readAcks();
+
+    unsigned long now = millis();
+    for (uint8_t i = 0; i < _window; i++)
+    {
+        reliable_slot &state = _slots[i];
+        if (!state.used || now - state.sentAt < state.timeout)
+        {
+            continue;
+        }
+        if (state.transmissions > RELIABLE_MAX_RETRANSMIT)
+        {
+            complete(i, false);
+        }
+        else
+        {
+            _retransmissions++;
+            transmit(i);
+        }
+    }
+}
+
+bool ReliableLinkBase::flush()
+{
+    uint32_t lost = _lost;
+    while (outstanding() > 0)
+    {
+        poll();
+        yield();
+    }
+    return _lost == lost;
+}
+
+void ReliableLinkBase::readAcks()
+{
+    char frame[RELIABLE_ACK_SIZE];
+    size_t length;
+    while ((length = _nbiot.receiveBytes(_socket, frame, sizeof(frame))) > 0)
+    {
+        bool valid = length == RELIABLE_ACK_SIZE && frame[0] == RELIABLE_ACK &&
+            _nbiot.receivedFromIP(_socket) == _remoteIP && _nbiot.receivedFromPort(_socket) == _remotePort;
+        // Skip the rest of a datagram that isn't an acknowledgement
+        while (_nbiot.receivedBytesRemaining(_socket) > 0)
+        {
+            valid = false;
+            if (_nbiot.receiveBytes(_socket, frame, sizeof(frame)) == 0)
+            {
+                break;
+            }
+        }
+        if (valid)
+        {
+            handleAck((uint8_t)frame[1] << 8 | (uint8_t)frame[2], (uint8_t)frame[3] << 8 | (uint8_t)frame[4]);
+        }
+    }
+}
+
+void ReliableLinkBase::handleAck(uint16_t sequence, uint16_t bitmap)
+{
+    unsigned long now = millis();
+    for (uint8_t i = 0; i < _window; i++)
+    {
+        reliable_slot &state = _slots[i];
+        if (!state.used)
+        {
+            continue;
+        }
+        uint16_t before = sequence - state.sequence;
+        if (before == 0 || (before <= 16 && (bitmap >> (before - 1)) & 1))
+        {
+            // Only datagrams sent once tell the round trip time (Karn's
+            // algorithm), as it's not known which copy was acknowledged
+            if (state.transmissions == 1)
+            {
+                sampleRoundTrip(now - state.sentAt);
+            }
+            complete(i, true);
+        }
+        else if (before <= 16 && state.transmissions == 1)
+        {
+            // A later datagram got through, so this one was most likely
+            // lost. Send it again right away.
+            state.timeout = 0;
+        }
+    }
+}
+
+void ReliableLinkBase::sampleRoundTrip(unsigned long rtt)
+{
+    if (!_rttMeasured)
+    {
+        _srtt = rtt;
+        _rttvar = rtt / 2;
+        _rttMeasured = true;
+    }
+    else
+    {
+        unsigned long deviation = _srtt > rtt ? _srtt - rtt : rtt - _srtt;
+        _rttvar = (3 * _rttvar + deviation) / 4;
+        _srtt = (7 * _srtt + rtt) / 8;
+    }
+    _rto = _srtt + 4 * _rttvar;
+    if (_rto < RELIABLE_MIN_RTO)
+    {
+        _rto = RELIABLE_MIN_RTO;
+    }
+    else if (_rto > RELIABLE_MAX_RTO)
+    {
+        _rto = RELIABLE_MAX_RTO;
+    }
+}
+
+void ReliableLinkBase::complete(uint8_t slot, bool delivered)
+{
+    _slots[slot].used = false;
+    if (delivered)
+    {
+        _delivered++;
+    }
+    else
+    {
+        _lost++;
+    }
+    if (_deliveryCallback)
+    {
+        _deliveryCallback(_slots[slot].sequence, delivered);
+    }
+}
+
+void ReliableLinkBase::onDelivery(delivery_callback callback)
+{
+    _deliveryCallback = nonstd::move(callback);
+}
+
+uint8_t ReliableLinkBase::outstanding()
+{
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < _window; i++)
+    {
+        if (_slots[i].used)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+unsigned long ReliableLinkBase::rto()
+{
+    return _rto;
+}
+
+unsigned long ReliableLinkBase::roundTripTime()
+{
+    return _rttMeasured ? _srtt : 0;
+}
+
+uint32_t ReliableLinkBase::delivered()
+{
+    return _delivered;
+}
+
+uint32_t ReliableLinkBase::retransmissions()
+{
+    return _retransmissions;
+}
+
+uint32_t ReliableLinkBase::lost()
+{
+    return _lost;
+}
@@ -0,0 +1,194 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef TELENOR_NBIOT_RELIABLE_H
+#define TELENOR_NBIOT_RELIABLE_H
+
+#include "TelenorNBIoT.h"
+
+// Default number of datagrams waiting for an acknowledgement at a time
+#define RELIABLE_WINDOW 4
+// Default size of the datagrams, not counting the 3 byte header
+#define RELIABLE_PAYLOAD_SIZE 64
+// Limits for the retransmission timeout, in milliseconds. The timeout
+// starts out at the initial value and is adjusted to the measured round
+// trip times.
+#define RELIABLE_INITIAL_RTO 8000
+#define RELIABLE_MIN_RTO 2000
+#define RELIABLE_MAX_RTO 64000
+// Times a datagram is sent again before it is given up
+#define RELIABLE_MAX_RETRANSMIT 4
+// Frame types, the first byte of a frame
+#define RELIABLE_DATA 0x01
+#define RELIABLE_ACK 0x02
+
+/**
+ * Delivery confirmation for datagrams sent to a server, on a socket of its
+ * own. Each datagram gets a sequence number, and the server acknowledges
+ * the datagrams it receives. Only the datagrams that aren't acknowledged
+ * are sent again, after a timeout that adapts to the measured round trip
+ * time (as in RFC 6298), or right away when a later datagram has been
+ * acknowledged.
+ *
+ * Datagrams are sent as
+ *
+ *     <0x01> <sequence number, 2 bytes> <payload>
+ *
+ * and the server answers each of them with
+ *
+ *     <0x02> <sequence number, 2 bytes> <bitmap, 2 bytes>
+ *
+ * where bit n of the bitmap is set if the datagram n + 1 before it has been
+ * received as well, so one acknowledgement makes up for the ones that were
+ * lost. All numbers are big endian. The server drops datagrams it has
+ * already received, but acknowledges them again.
+ *
+ * Datagrams are sent with psm_sleep_after_response (unless the power save
+ * mode is psm_always_on), so the module releases the radio as soon as the
+ * acknowledgement has arrived.
+ *
+ * The buffers are provided by BasicReliableLink below, so use ReliableLink
+ * or BasicReliableLink with the sizes you need.
+ */
+class ReliableLinkBase
+{
+  public:
+    /**
+     * Invoked from poll() when a datagram has been acknowledged, or has been
+     * given up after RELIABLE_MAX_RETRANSMIT retransmissions.
+     */
+    typedef nonstd::function<void (uint16_t sequence, bool delivered)> delivery_callback;
+
+    /**
+     * Open a socket listening on the local port for acknowledgements from
+     * the server.
+     */
+    bool begin(uint16_t localPort, IPAddress remoteIP, uint16_t remotePort);
+
+    /**
+     * Close the socket. Datagrams still waiting are given up.
+     */
+    void stop();
+
+    /**
+     * Send a datagram. Returns its sequence number, or -1 if it is too long
+     * or all the datagrams in the window are waiting for an
+     * acknowledgement. If the module fails to send it, it is sent again
+     * like a lost datagram.
+     */
+    long send(const char *data, uint16_t length);
+
+    /**
+     * Read acknowledgements and send datagrams again when their timeout has
+     * passed. Call this from loop().
+     */
+    void poll();
+
+    /**
+     * Wait until all the datagrams have been acknowledged or given up.
+     * Returns true if all of them were acknowledged.
+     */
+    bool flush();
+
+    /**
+     * Set a callback to be invoked when a datagram has been delivered or
+     * given up.
+     */
+    void onDelivery(delivery_callback callback);
+
+    /**
+     * Number of datagrams waiting for an acknowledgement.
+     */
+    uint8_t outstanding();
+
+    /**
+     * The current retransmission timeout and the smoothed round trip time,
+     * in milliseconds. The round trip time is 0 until it has been measured.
+     */
+    unsigned long rto();
+    unsigned long roundTripTime();
+
+    /**
+     * Counters since begin().
+     */
+    uint32_t delivered();
+    uint32_t retransmissions();
+    uint32_t lost();
+
+  protected:
+    struct reliable_slot {
+        bool used = false;
+        uint16_t sequence = 0;
+        uint16_t length = 0;
+        uint8_t transmissions = 0;
+        unsigned long sentAt = 0;
+        unsigned long timeout = 0;
+    };
+
+    ReliableLinkBase(TelenorNBIoTBase &nbiot, reliable_slot *slots, uint8_t window, char *storage, uint16_t payloadSize);
+
+  private:
+    TelenorNBIoTBase &_nbiot;
+    reliable_slot *_slots;
+    uint8_t _window;
+    char *_storage;
+    uint16_t _payloadSize;
+
+    int _socket = -1;
+    IPAddress _remoteIP;
+    uint16_t _remotePort = 0;
+    uint16_t _nextSequence = 0;
+    delivery_callback _deliveryCallback;
+
+    bool _rttMeasured = false;
+    unsigned long _srtt = 0;
+    unsigned long _rttvar = 0;
+    unsigned long _rto = RELIABLE_INITIAL_RTO;
+
+    uint32_t _delivered = 0;
+    uint32_t _retransmissions = 0;
+    uint32_t _lost = 0;
+
+    bool transmit(uint8_t slot);
+    void readAcks();
+    void handleAck(uint16_t sequence, uint16_t bitmap);
+    void sampleRoundTrip(unsigned long rtt);
+    void complete(uint8_t slot, bool delivered);
+};
+
+/**
+ * A reliable link with Window datagrams waiting for acknowledgement at a
+ * time, each with up to PayloadSize bytes.
+ */
+template<uint8_t Window, uint16_t PayloadSize>
+class BasicReliableLink : public ReliableLinkBase
+{
+    static_assert(Window >= 1 && Window <= 16, "The bitmap covers up to 16 datagrams");
+    static_assert(PayloadSize >= 1 && PayloadSize <= MAX_DATAGRAM_SIZE - 3, "The module sends up to 512 bytes");
+
+  public:
+    BasicReliableLink(TelenorNBIoTBase &nbiot)
+        : ReliableLinkBase(nbiot, _slotStorage, Window, _dataStorage, PayloadSize)
+    {
+    }
+
+  private:
+    reliable_slot _slotStorage[Window];
+    char _dataStorage[Window * PayloadSize];
+};
+
+typedef BasicReliableLink<RELIABLE_WINDOW, RELIABLE_PAYLOAD_SIZE> ReliableLink;
+
+#endif
@@ -0,0 +1,37 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef TELENOR_NBIOT_REPLYHINT_H
+#define TELENOR_NBIOT_REPLYHINT_H
+
+#include <Udp.h>
+
+/**
+ * The Arduino UDP interface with a hint that the packet being written will
+ * be answered. Protocols on top of UDP, like CoapClient, give the hint
+ * through this interface, so they don't depend on the UDP implementation.
+ * Implementations use it f.e. to keep the radio up for the answer.
+ */
+class ReplyHintUDP : public UDP
+{
+  public:
+    /**
+     * Tell whether the packet being written is answered, f.e. with an
+     * acknowledgement. Called after beginPacket().
+     */
+    virtual void setReplyExpected(bool replyExpected) = 0;
+};
+
+#endif
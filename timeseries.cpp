@@ -0,0 +1,183 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <string.h>
+#include "timeseries.h"
+
+size_t telenor_nbiot::writeVarint(uint8_t *out, size_t size, uint32_t value)
+{
+    size_t length = 0;
+    do
+    {
+        if (length == size)
+        {
+            return 0;
+        }
+        uint8_t b = value & 0x7F;
+        value >>= 7;
+        out[length++] = value ? b | 0x80 : b;
+    } while (value);
+    return length;
+}
+
+uint32_t telenor_nbiot::zigzagEncode(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+int32_t telenor_nbiot::zigzagDecode(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+bool SeriesEncoder::begin(uint8_t *buffer, size_t size, uint8_t fields)
+{
+    _buffer = buffer;
+    _size = size;
+    _fields = fields;
+    if (buffer == NULL || size < 1 || fields > SERIES_MAX_FIELDS)
+    {
+        _size = 0;
+        return false;
+    }
+    clear();
+    return true;
+}
+
+void SeriesEncoder::clear()
+{
+    _length = 0;
+    _count = 0;
+    if (_size > 0)
+    {
+        _buffer[_length++] = _fields;
+    }
+}
+
+bool SeriesEncoder::add(uint32_t timestamp, const int32_t *values)
+{
+    if (_size == 0 || (_count > 0 && timestamp < _timestamp))
+    {
+        return false;
+    }
+
+    // The differences wrap around like the values would, so they decode
+    // to the same values
+    size_t length = _length;
+    size_t written = telenor_nbiot::writeVarint(_buffer + length, _size - length, _count > 0 ? timestamp - _timestamp : timestamp);
+    for (uint8_t i = 0; i < _fields && written > 0; i++)
+    {
+        length += written;
+        uint32_t delta = _count > 0 ? (uint32_t)values[i] - (uint32_t)_values[i] : (uint32_t)values[i];
+        written = telenor_nbiot::writeVarint(_buffer + length, _size - length, telenor_nbiot::zigzagEncode((int32_t)delta));
+    }
+    if (written == 0)
+    {
+        // Whatever was written after _length is ignored
+        return false;
+    }
+
+    _length = length + written;
+    _count++;
+    _timestamp = timestamp;
+    memcpy(_values, values, _fields * sizeof(int32_t));
+    return true;
+}
+
+const char *SeriesEncoder::data() const
+{
+    return (const char *)_buffer;
+}
+
+size_t SeriesEncoder::length() const
+{
+    return _length;
+}
+
+uint16_t SeriesEncoder::count() const
+{
+    return _count;
+}
+
+bool SeriesDecoder::begin(const uint8_t *data, size_t length)
+{
+    _data = data;
+    _length = length;
+    _offset = 1;
+    _count = 0;
+    _fields = length > 0 ? data[0] : 0;
+    if (length == 0 || _fields > SERIES_MAX_FIELDS)
+    {
+        _length = 0;
+        return false;
+    }
+    return true;
+}
+
+uint8_t SeriesDecoder::fields() const
+{
+    return _fields;
+}
+
+bool SeriesDecoder::readVarint(uint32_t &value)
+{
+    value = 0;
+    for (uint8_t shift = 0; shift < 35; shift += 7)
+    {
+        if (_offset >= _length)
+        {
+            return false;
+        }
+        uint8_t b = _data[_offset++];
+        value |= (uint32_t)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    // Longer than a 32 bit value
+    return false;
+}
+
+bool SeriesDecoder::next(uint32_t &timestamp, int32_t *values)
+{
+    if (_offset >= _length)
+    {
+        return false;
+    }
+
+    uint32_t value;
+    if (!readVarint(value))
+    {
+        _length = 0;
+        return false;
+    }
+    _timestamp = _count > 0 ? _timestamp + value : value;
+    for (uint8_t i = 0; i < _fields; i++)
+    {
+        if (!readVarint(value))
+        {
+            _length = 0;
+            return false;
+        }
+        int32_t delta = telenor_nbiot::zigzagDecode(value);
+        _values[i] = _count > 0 ? (int32_t)((uint32_t)_values[i] + (uint32_t)delta) : delta;
+    }
+
+    _count++;
+    timestamp = _timestamp;
+    memcpy(values, _values, _fields * sizeof(int32_t));
+    return true;
+}
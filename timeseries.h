@@ -0,0 +1,142 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef TELENOR_NBIOT_TIMESERIES_H
+#define TELENOR_NBIOT_TIMESERIES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest number of values in each reading.
+#define SERIES_MAX_FIELDS 8
+
+/**
+ * Encodes readings from sensors with a fixed set of values into a compact
+ * datagram for sendBytes(). Each reading has a timestamp and up to
+ * SERIES_MAX_FIELDS signed values. The format is:
+ *
+ *     <field count> <reading> <reading> ...
+ *
+ * The first reading has the timestamp and values as they are, the others
+ * have the difference from the reading before. Timestamps are unsigned
+ * varints, values are zigzag encoded signed varints, so values that change
+ * slowly take a byte each. A varint has 7 bits in each byte, least
+ * significant first, with the top bit set on all bytes but the last.
+ *
+ * Scale the values to integers before adding them, f.e. the temperature in
+ * hundredths of a degree.
+ */
+class SeriesEncoder
+{
+  public:
+    /**
+     * Start a new datagram in the buffer, with the given number of values in
+     * each reading. Returns false if the count is too large or the buffer
+     * is too small.
+     */
+    bool begin(uint8_t *buffer, size_t size, uint8_t fields);
+
+    /**
+     * Add a reading. The timestamp must not be earlier than the one before,
+     * f.e. seconds from millis() or an RTC. Returns false, and leaves the
+     * datagram as it was, if the reading doesn't fit.
+     */
+    bool add(uint32_t timestamp, const int32_t *values);
+
+    /**
+     * Start over with an empty datagram in the same buffer, f.e. after it
+     * has been sent.
+     */
+    void clear();
+
+    /**
+     * The datagram, to pass to sendBytes().
+     */
+    const char *data() const;
+
+    /**
+     * Length of the datagram in bytes.
+     */
+    size_t length() const;
+
+    /**
+     * Number of readings in the datagram.
+     */
+    uint16_t count() const;
+
+  private:
+    uint8_t *_buffer = NULL;
+    size_t _size = 0;
+    size_t _length = 0;
+    uint8_t _fields;
+    uint16_t _count;
+    uint32_t _timestamp;
+    int32_t _values[SERIES_MAX_FIELDS];
+};
+
+/**
+ * Decodes a datagram written by SeriesEncoder. This doesn't depend on
+ * Arduino, so it can be compiled as it is on the server receiving the data.
+ */
+class SeriesDecoder
+{
+  public:
+    /**
+     * Start decoding a datagram. Returns false if it is empty or has too
+     * many values in each reading.
+     */
+    bool begin(const uint8_t *data, size_t length);
+
+    /**
+     * Number of values in each reading.
+     */
+    uint8_t fields() const;
+
+    /**
+     * Decode the next reading into timestamp and values, which must have
+     * room for fields() values. Returns false at the end of the datagram or
+     * if it is malformed.
+     */
+    bool next(uint32_t &timestamp, int32_t *values);
+
+  private:
+    const uint8_t *_data;
+    size_t _length;
+    size_t _offset;
+    uint8_t _fields;
+    uint16_t _count;
+    uint32_t _timestamp;
+    int32_t _values[SERIES_MAX_FIELDS];
+
+    bool readVarint(uint32_t &value);
+};
+
+namespace telenor_nbiot
+{
+    /**
+     * Write a value as an unsigned varint. Returns the number of bytes
+     * written, or 0 if it doesn't fit in size bytes.
+     */
+    size_t writeVarint(uint8_t *out, size_t size, uint32_t value);
+
+    /**
+     * Map signed values to unsigned so small negative values stay small:
+     * 0, -1, 1, -2, 2... become 0, 1, 2, 3, 4...
+     */
+    uint32_t zigzagEncode(int32_t value);
+    int32_t zigzagDecode(uint32_t value);
+}
+
+#endif
@@ -0,0 +1,169 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "tokenizer.h"
+
+ATTokenizer::ATTokenizer()
+{
+    reset();
+}
+
+void ATTokenizer::reset()
+{
+    startLine();
+}
+
+void ATTokenizer::startLine()
+{
+    _field[0] = 0;
+    _prefix[0] = 0;
+    _length = 0;
+    _count = 0;
+    _started = false;
+    _quoted = false;
+    _afterPrefix = false;
+    _lineDone = false;
+}
+
+void ATTokenizer::endField()
+{
+    // The field stays in the buffer until the next character arrives
+    _field[_length] = 0;
+    _length = 0;
+    if (_count < TOKEN_VALUES)
+    {
+        _values[_count] = atol(_field);
+    }
+    _count++;
+}
+
+uint8_t ATTokenizer::write(char c)
+{
+    if (c == '\r')
+    {
+        return 0;
+    }
+    if (c == '\n')
+    {
+        if (!_started || _lineDone)
+        {
+            // Empty line
+            return 0;
+        }
+        endField();
+        _lineDone = true;
+        return TOKEN_FIELD | TOKEN_LINE;
+    }
+
+    if (_lineDone)
+    {
+        // The previous line stays available until the next line starts
+        startLine();
+    }
+    _started = true;
+
+    if (c == '"')
+    {
+        _quoted = !_quoted;
+        return 0;
+    }
+    if (!_quoted)
+    {
+        if (c == ',')
+        {
+            endField();
+            return TOKEN_FIELD;
+        }
+        if (c == ':' && _count == 0 && _prefix[0] == 0)
+        {
+            // Everything up to the first colon is the prefix
+            _field[_length] = 0;
+            strncpy(_prefix, _field, TOKEN_PREFIX_SIZE - 1);
+            _prefix[TOKEN_PREFIX_SIZE - 1] = 0;
+            _length = 0;
+            _afterPrefix = true;
+            return 0;
+        }
+        if (c == ' ' && _afterPrefix)
+        {
+            // Skip the space after the prefix
+            _afterPrefix = false;
+            return 0;
+        }
+    }
+    _afterPrefix = false;
+
+    if (_length < TOKEN_FIELD_SIZE - 1)
+    {
+        _field[_length++] = c;
+    }
+    return 0;
+}
+
+const char *ATTokenizer::prefix() const
+{
+    return _prefix;
+}
+
+bool ATTokenizer::hasPrefix(const char *prefix) const
+{
+    return strcmp(_prefix, prefix) == 0;
+}
+
+uint8_t ATTokenizer::index() const
+{
+    return _count > 0 ? _count - 1 : 0;
+}
+
+uint8_t ATTokenizer::count() const
+{
+    return _count;
+}
+
+const char *ATTokenizer::text() const
+{
+    return _field;
+}
+
+long ATTokenizer::value() const
+{
+    return atol(_field);
+}
+
+long ATTokenizer::value(uint8_t index) const
+{
+    return index < _count && index < TOKEN_VALUES ? _values[index] : 0;
+}
+
+bool ATTokenizer::inQuotes() const
+{
+    return _quoted;
+}
+
+bool ATTokenizer::isOK() const
+{
+    return _lineDone && _prefix[0] == 0 && _count == 1 && strcmp(_field, "OK") == 0;
+}
+
+bool ATTokenizer::isError() const
+{
+    return _lineDone && ((_prefix[0] == 0 && _count == 1 && strcmp(_field, "ERROR") == 0) ||
+        hasPrefix("+CME ERROR"));
+}
+
+int ATTokenizer::errorCode() const
+{
+    return hasPrefix("+CME ERROR") ? value(0) : -2;
+}
@@ -0,0 +1,135 @@
+/*
+   Copyright 2018 Telenor Digital AS
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef TELENOR_NBIOT_TOKENIZER_H
+#define TELENOR_NBIOT_TOKENIZER_H
+
+#include <Arduino.h>
+
+// Longest field kept, including the terminating zero. Longer fields are cut.
+#define TOKEN_FIELD_SIZE 40
+// Longest line prefix kept, f.e. "+CGDCONT", including the terminating zero.
+#define TOKEN_PREFIX_SIZE 16
+// Number of fields in a line whose numeric value is kept.
+#define TOKEN_VALUES 6
+
+// Events returned by ATTokenizer::write()
+#define TOKEN_FIELD 1
+#define TOKEN_LINE 2
+
+/**
+ * Splits the response from the module into fields as the bytes arrive,
+ * without keeping whole lines. A line like
+ *
+ *     +CGDCONT: 0,"IP","mda.ee",,0,0
+ *
+ * has the prefix "+CGDCONT" and the fields 0, IP, mda.ee, an empty field,
+ * 0 and 0. Quotes are removed, and commas inside quotes don't split
+ * fields. Lines like "TX time:1239" have a prefix as well. Lines without a
+ * prefix, like "OK" or a socket number, only have fields.
+ *
+ * Only the field that was just completed is kept, along with the numeric
+ * value of the first fields in the line, so lines can be any length.
+ */
+class ATTokenizer
+{
+  public:
+    ATTokenizer();
+
+    /**
+     * Forget the line read so far.
+     */
+    void reset();
+
+    /**
+     * Add a character. Returns TOKEN_FIELD when a field has been completed,
+     * and TOKEN_LINE as well when the line has been completed. Returns 0
+     * otherwise, and for empty lines.
+     */
+    uint8_t write(char c);
+
+    /**
+     * The prefix of the current line, or an empty string.
+     */
+    const char *prefix() const;
+
+    /**
+     * Returns true if the prefix of the current line is the given string.
+     */
+    bool hasPrefix(const char *prefix) const;
+
+    /**
+     * Index of the field that was just completed.
+     */
+    uint8_t index() const;
+
+    /**
+     * Number of fields completed in the current line.
+     */
+    uint8_t count() const;
+
+    /**
+     * The field that was just completed, without quotes.
+     */
+    const char *text() const;
+
+    /**
+     * The numeric value of the field that was just completed.
+     */
+    long value() const;
+
+    /**
+     * The numeric value of an earlier field in the current line, or 0 if it
+     * isn't kept.
+     */
+    long value(uint8_t index) const;
+
+    /**
+     * Returns true while inside a quoted string.
+     */
+    bool inQuotes() const;
+
+    /**
+     * Returns true when the line that was just completed is "OK".
+     */
+    bool isOK() const;
+
+    /**
+     * Returns true when the line that was just completed is "ERROR" or
+     * "+CME ERROR: <code>".
+     */
+    bool isError() const;
+
+    /**
+     * The error code of a "+CME ERROR" line, or -2 for a plain "ERROR".
+     */
+    int errorCode() const;
+
+  private:
+    char _field[TOKEN_FIELD_SIZE];
+    char _prefix[TOKEN_PREFIX_SIZE];
+    long _values[TOKEN_VALUES];
+    uint8_t _length;
+    uint8_t _count;
+    bool _started;
+    bool _quoted;
+    bool _afterPrefix;
+    bool _lineDone;
+
+    void startLine();
+    void endField();
+};
+
+#endif